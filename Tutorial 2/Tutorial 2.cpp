@@ -1,24 +1,1852 @@
 #define INT_BIN_SIZE 256
 
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
 #include <iostream>
+#include <numeric>
+#include <random>
 #include <vector>
 
 #include "Utils.h"
 #include "CImg.h"
 
+/* Images up to this many pixels (width x height x depth, any number of channels) are equalised by the single-launch
+   hist_equalise_fused kernel, which runs on one work-group: the 256x256 thumbnails it was written for. */
+#define FUSED_MAX_PIXELS (256 * 256)
+
+/* Rank-1 masks of at least this radius are run as two 1D passes; below it the float intermediate of the row pass
+   costs more memory traffic than the tiled 2D kernel saves in arithmetic. */
+#define SEPARABLE_MIN_RADIUS 3
+
 /* Use when running this code on the personal machine. */
 //#include <include/CL/cl.h>
 
-using namespace cimg_library;
+using namespace cimg_library;
+
+void print_help() {
+	std::cerr << "Application usage:" << std::endl;
+
+	std::cerr << "  -p : select platform " << std::endl;
+	std::cerr << "  -d : select device" << std::endl;
+	std::cerr << "  -l : list all platforms and devices" << std::endl;
+	std::cerr << "  -f : input image file (default: test.ppm)" << std::endl;
+	std::cerr << "  -k : histogram kernel, simple | local | replicated, grey or -c joint images (default: simple)" << std::endl;
+	std::cerr << "  -r : number of sub-histograms per work-group for -k replicated, up to what fits in local memory (default: 8)" << std::endl;
+	std::cerr << "  -s : cumulative histogram scan, single | hierarchical | lookback (default: single work-group)" << std::endl;
+	std::cerr << "  -c : colour images, luma (equalise Y of YCbCr only) | joint (one histogram over all channels) (default: luma)" << std::endl;
+	std::cerr << "  -denoise : smooth 8-bit images with the 3x3 box filter on the device before equalising" << std::endl;
+	std::cerr << "  -blur : like -denoise, with a separable Gaussian of the given sigma (radius ceil(3 sigma), e.g. 2.5 for 15x15)" << std::endl;
+	std::cerr << "  -match : match the histogram of 8-bit images to a reference .pgm/.ppm image or a text file of 256 bin counts" << std::endl;
+	std::cerr << "  -clahe : contrast-limited adaptive equalisation on a WxH tile grid, e.g. 8x8 (default: off, global equalisation)" << std::endl;
+	std::cerr << "  -clip : CLAHE clip limit, multiple of the mean bin count of a tile, 0 disables clipping (default: 2)" << std::endl;
+	std::cerr << "  -fuse : largest image (in pixels) equalised by the single-launch fused kernel, 0 disables (default: " << FUSED_MAX_PIXELS << ", 0 with -k, -s, -w or -images)" << std::endl;
+	std::cerr << "  -w : pixels per work-item, 1 | 2 | 4 | 8 | 16, grey or -c joint images (default: device preferred char vector width)" << std::endl;
+	std::cerr << "  --dump-intermediates : read back and print the histogram, cumulative histogram and LUT" << std::endl;
+	std::cerr << "  -levels : auto-levels, stretch between the low and high percentiles instead of equalising, e.g. 1,99" << std::endl;
+	std::cerr << "  -otsu : threshold the output with 1 (Otsu, binary) to 4 (multi-Otsu) thresholds found on the device, colour images on their luma (-c luma) as grey output, 2-4 thresholds on 8-bit images only" << std::endl;
+	std::cerr << "  -lut : LUT arithmetic, double | fixed (64-bit integer, same results) | auto (fixed without fp64 support) (default: auto)" << std::endl;
+	std::cerr << "  -images : read the input of the convolution, remap and CLAHE kernels through image objects (falls back to buffers without image support)" << std::endl;
+	std::cerr << "  -qa : print the input statistics (min, max, mean, variance) and per-channel histograms and cumulative histograms (-batch: save them as <name>_stats.csv and <name>_hist.csv)" << std::endl;
+	std::cerr << "  -batch : equalise every .pgm/.ppm of a directory, or every file listed (one per line) in a text file" << std::endl;
+	std::cerr << "  -o : output directory for -batch (default: next to the input, with an _eq suffix)" << std::endl;
+	std::cerr << "  -cache : directory of the compiled program cache (default: kernel_cache)" << std::endl;
+	std::cerr << "  -nocache : always compile the kernels from source" << std::endl;
+	std::cerr << "  -bench : run the histogram (including generic uchar/ushort/int/float) and scan benchmarks instead of processing an image" << std::endl;
+	std::cerr << "  -h : print this message" << std::endl;
+}
+
+/* Picks the number of pixels per work-item from CL_DEVICE_PREFERRED_VECTOR_WIDTH_CHAR (a power of two up to 16, 1 selects the scalar kernels). */
+int preferred_vector_width(const cl::Device& device) {
+	cl_uint width = device.getInfo<CL_DEVICE_PREFERRED_VECTOR_WIDTH_CHAR>();
+	int vec_width = 1;
+
+	while (((cl_uint)vec_width * 2 <= width) && (vec_width < 16)) { vec_width *= 2; }
+
+	return vec_width;
+}
+
+/* True if the device supports double precision in kernels (cl_khr_fp64). */
+bool device_has_fp64(const cl::Device& device) {
+	return device.getInfo<CL_DEVICE_EXTENSIONS>().find("cl_khr_fp64") != string::npos;
+}
+
+/* Enqueues one of the 256-bin histogram kernels over N pixels. H must be zeroed beforehand.
+   With vec_width > 1 the _vec variants are used, each work-item reading vec_width pixels.
+   Like the other enqueue_ helpers, the kernel starts after wait_events and the returned event marks its completion. */
+cl::Event enqueue_histogram(cl::CommandQueue& queue, cl::Program& program, const string& hist_kernel, cl::Buffer& image, cl::Buffer& H, size_t N, int nr_bins, int replicas, int vec_width, const std::vector<cl::Event>* wait_events = NULL) {
+	cl::Event prof_event;
+	string suffix = (vec_width > 1) ? "_vec" : "";
+	size_t work_items = (N + vec_width - 1) / vec_width;
+
+	if ((hist_kernel == "local") || (hist_kernel == "replicated")) {
+		/* Local Memory Histogram -> each work-group merges its private copy with one atomic_add per bin */
+		cl::Kernel kernel_hist_local = cl::Kernel(program, (((hist_kernel == "local") ? "hist_local_simple" : "hist_local_replicated") + suffix).c_str());
+		size_t local_hist_size = nr_bins * sizeof(int) * ((hist_kernel == "local") ? 1 : replicas);
+
+		cl::Device device = queue.getInfo<CL_QUEUE_DEVICE>();
+		size_t local_size = std::min<size_t>(256, kernel_hist_local.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device));
+		size_t global_size = ((work_items + local_size - 1) / local_size) * local_size;
+
+		kernel_hist_local.setArg(0, image);
+		kernel_hist_local.setArg(1, H);
+		kernel_hist_local.setArg(2, cl::Local(local_hist_size));
+		kernel_hist_local.setArg(3, nr_bins);
+		kernel_hist_local.setArg(4, (int)N);
+
+		queue.enqueueNDRangeKernel(kernel_hist_local, cl::NullRange, cl::NDRange(global_size), cl::NDRange(local_size), wait_events, &prof_event);
+	}
+	else if (vec_width > 1) {
+		cl::Kernel kernel_hist_simple = cl::Kernel(program, "hist_simple_vec");
+		kernel_hist_simple.setArg(0, image);
+		kernel_hist_simple.setArg(1, H);
+		kernel_hist_simple.setArg(2, (int)N);
+
+		queue.enqueueNDRangeKernel(kernel_hist_simple, cl::NullRange, cl::NDRange(work_items), cl::NullRange, wait_events, &prof_event);
+	}
+	else {
+		cl::Kernel kernel_hist_simple = cl::Kernel(program, "hist_simple");
+		kernel_hist_simple.setArg(0, image);
+		kernel_hist_simple.setArg(1, H);
+
+		queue.enqueueNDRangeKernel(kernel_hist_simple, cl::NullRange, cl::NDRange(N), cl::NullRange, wait_events, &prof_event);
+	}
+
+	return prof_event;
+}
+
+/* Enqueues the work-group scan of a histogram of nr_bins (hist_cumulative) on a single power-of-two work-group,
+   or of nr_histograms histograms stored back to back with one work-group each. */
+cl::Event enqueue_cumulative(cl::CommandQueue& queue, cl::Program& program, cl::Buffer& H, cl::Buffer& CH, int nr_bins, bool inclusive, const std::vector<cl::Event>* wait_events = NULL, int nr_histograms = 1) {
+	cl::Event prof_event;
+	cl::Kernel kernel_cumulative = cl::Kernel(program, "hist_cumulative");
+
+	cl::Device device = queue.getInfo<CL_QUEUE_DEVICE>();
+	size_t local_size = PowerOfTwoLocalSize(kernel_cumulative, device, nr_bins);
+
+	kernel_cumulative.setArg(0, H);
+	kernel_cumulative.setArg(1, CH);
+	kernel_cumulative.setArg(2, cl::Local(local_size * sizeof(int)));
+	kernel_cumulative.setArg(3, nr_bins);
+	kernel_cumulative.setArg(4, (int)inclusive);
+
+	queue.enqueueNDRangeKernel(kernel_cumulative, cl::NullRange, cl::NDRange(nr_histograms * local_size), cl::NDRange(local_size), wait_events, &prof_event);
+
+	return prof_event;
+}
+
+/* Enqueues the whole 256-bin equalisation of N pixels from A to B as one hist_equalise_fused launch (one work-group). */
+cl::Event enqueue_equalise_fused(cl::CommandQueue& queue, cl::Program& program, cl::Buffer& A, cl::Buffer& B, size_t N, const std::vector<cl::Event>* wait_events = NULL) {
+	cl::Event prof_event;
+	cl::Kernel kernel_fused = cl::Kernel(program, "hist_equalise_fused");
+
+	cl::Device device = queue.getInfo<CL_QUEUE_DEVICE>();
+	size_t local_size = PowerOfTwoLocalSize(kernel_fused, device, 1024);
+
+	kernel_fused.setArg(0, A);
+	kernel_fused.setArg(1, B);
+	kernel_fused.setArg(2, cl::Local(INT_BIN_SIZE * sizeof(int)));
+	kernel_fused.setArg(3, cl::Local(local_size * sizeof(int)));
+	kernel_fused.setArg(4, (int)N);
+
+	queue.enqueueNDRangeKernel(kernel_fused, cl::NullRange, cl::NDRange(local_size), cl::NDRange(local_size), wait_events, &prof_event);
+
+	return prof_event;
+}
+
+/* Enqueues LUT_table, one work-item per bin, turning the inclusive cumulative histogram CH into LUT.
+   With fixed_point, LUT_table_fixed computes the same values in integer arithmetic (devices without fp64). */
+cl::Event enqueue_lut(cl::CommandQueue& queue, cl::Program& program, cl::Buffer& CH, cl::Buffer& LUT, int nr_bins, const std::vector<cl::Event>* wait_events = NULL, bool fixed_point = false) {
+	cl::Event prof_event;
+	cl::Kernel kernel_lut_table = cl::Kernel(program, fixed_point ? "LUT_table_fixed" : "LUT_table");
+
+	kernel_lut_table.setArg(0, CH);
+	kernel_lut_table.setArg(1, LUT);
+	kernel_lut_table.setArg(2, nr_bins);
+
+	queue.enqueueNDRangeKernel(kernel_lut_table, cl::NullRange, cl::NDRange(nr_bins), cl::NullRange, wait_events, &prof_event);
+
+	return prof_event;
+}
+
+/* Enqueues LUT_table_uchar, the 8-bit equalisation LUT in the compact form (nr_bins uchar) for enqueue_remap_compact. */
+cl::Event enqueue_lut_compact(cl::CommandQueue& queue, cl::Program& program, cl::Buffer& CH, cl::Buffer& LUT, int nr_bins, const std::vector<cl::Event>* wait_events = NULL, bool fixed_point = false) {
+	cl::Event prof_event;
+	cl::Kernel kernel_lut_table = cl::Kernel(program, fixed_point ? "LUT_table_fixed_uchar" : "LUT_table_uchar");
+
+	kernel_lut_table.setArg(0, CH);
+	kernel_lut_table.setArg(1, LUT);
+	kernel_lut_table.setArg(2, nr_bins);
+
+	queue.enqueueNDRangeKernel(kernel_lut_table, cl::NullRange, cl::NDRange(nr_bins), cl::NullRange, wait_events, &prof_event);
+
+	return prof_event;
+}
+
+/* Quantiles as fractions of QUANTILE_ONE, the fixed-point unit of hist_quantiles, passed to my_kernels.cl as -DQUANTILE_ONE. */
+#define QUANTILE_ONE (1 << 24)
+
+/* Enqueues hist_quantiles: the bins of nr_quantiles quantiles (fractions in QUANTILE_ONE units) of the inclusive
+   cumulative histogram CH into Q, e.g. fractions { QUANTILE_ONE / 2 } for the median. The program must be built with
+   -DQUANTILE_ONE=<QUANTILE_ONE> unless QUANTILE_ONE keeps the kernel default (1 << 24). */
+cl::Event enqueue_quantiles(cl::CommandQueue& queue, cl::Program& program, cl::Buffer& CH, cl::Buffer& fractions, cl::Buffer& Q, int nr_bins, int nr_quantiles, const std::vector<cl::Event>* wait_events = NULL) {
+	cl::Event prof_event;
+	cl::Kernel kernel_quantiles = cl::Kernel(program, "hist_quantiles");
+
+	kernel_quantiles.setArg(0, CH);
+	kernel_quantiles.setArg(1, fractions);
+	kernel_quantiles.setArg(2, Q);
+	kernel_quantiles.setArg(3, nr_bins);
+
+	queue.enqueueNDRangeKernel(kernel_quantiles, cl::NullRange, cl::NDRange(nr_bins, nr_quantiles), cl::NullRange, wait_events, &prof_event);
+
+	return prof_event;
+}
+
+/* Enqueues the auto-levels LUT: the two quantiles in fractions (low, high) into Q, then LUT_stretch from them into LUT.
+   Returns the event of the LUT kernel. */
+cl::Event enqueue_lut_levels(cl::CommandQueue& queue, cl::Program& program, cl::Buffer& CH, cl::Buffer& fractions, cl::Buffer& Q, cl::Buffer& LUT, int nr_bins, const std::vector<cl::Event>* wait_events = NULL) {
+	cl::Event prof_event;
+	std::vector<cl::Event> found(1, enqueue_quantiles(queue, program, CH, fractions, Q, nr_bins, 2, wait_events));
+
+	cl::Kernel kernel_stretch = cl::Kernel(program, "LUT_stretch");
+	kernel_stretch.setArg(0, Q);
+	kernel_stretch.setArg(1, LUT);
+	kernel_stretch.setArg(2, nr_bins);
+
+	queue.enqueueNDRangeKernel(kernel_stretch, cl::NullRange, cl::NDRange(nr_bins), cl::NullRange, &found, &prof_event);
+
+	return prof_event;
+}
+
+/* Enqueues LUT_match, one work-item per bin: the histogram matching LUT from the inclusive cumulative histograms
+   of the target (CH) and of the reference (reference_CH). */
+cl::Event enqueue_lut_match(cl::CommandQueue& queue, cl::Program& program, cl::Buffer& CH, cl::Buffer& reference_CH, cl::Buffer& LUT, int nr_bins, const std::vector<cl::Event>* wait_events = NULL) {
+	cl::Event prof_event;
+	cl::Kernel kernel_lut_match = cl::Kernel(program, "LUT_match");
+
+	kernel_lut_match.setArg(0, CH);
+	kernel_lut_match.setArg(1, reference_CH);
+	kernel_lut_match.setArg(2, LUT);
+	kernel_lut_match.setArg(3, nr_bins);
+
+	queue.enqueueNDRangeKernel(kernel_lut_match, cl::NullRange, cl::NDRange(nr_bins), cl::NullRange, wait_events, &prof_event);
+
+	return prof_event;
+}
+
+/* Enqueues LUT_redirective_compact over N pixels with a 256-byte LUT, the program's VEC_WIDTH (vec_width) pixels per work-item. */
+cl::Event enqueue_remap_compact(cl::CommandQueue& queue, cl::Program& program, cl::Buffer& A, cl::Buffer& LUT, cl::Buffer& B, size_t N, int vec_width, const std::vector<cl::Event>* wait_events = NULL) {
+	cl::Event prof_event;
+	cl::Kernel kernel_lut_redirective = cl::Kernel(program, "LUT_redirective_compact");
+
+	cl::Device device = queue.getInfo<CL_QUEUE_DEVICE>();
+	size_t local_size = std::min<size_t>(256, kernel_lut_redirective.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device));
+	size_t work_items = (N + vec_width - 1) / vec_width;
+
+	kernel_lut_redirective.setArg(0, A);
+	kernel_lut_redirective.setArg(1, LUT);
+	kernel_lut_redirective.setArg(2, B);
+	kernel_lut_redirective.setArg(3, cl::Local(INT_BIN_SIZE));
+	kernel_lut_redirective.setArg(4, (int)N);
+
+	queue.enqueueNDRangeKernel(kernel_lut_redirective, cl::NullRange, cl::NDRange(((work_items + local_size - 1) / local_size) * local_size), cl::NDRange(local_size), wait_events, &prof_event);
+
+	return prof_event;
+}
+
+/* Enqueues hist_luma, the 256-bin histogram of the luma of a planar RGB image of N pixels per channel. H must be zeroed beforehand. */
+cl::Event enqueue_histogram_luma(cl::CommandQueue& queue, cl::Program& program, cl::Buffer& image, cl::Buffer& H, size_t N, const std::vector<cl::Event>* wait_events = NULL) {
+	cl::Event prof_event;
+	cl::Kernel kernel_hist_luma = cl::Kernel(program, "hist_luma");
+
+	cl::Device device = queue.getInfo<CL_QUEUE_DEVICE>();
+	size_t local_size = std::min<size_t>(256, kernel_hist_luma.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device));
+
+	kernel_hist_luma.setArg(0, image);
+	kernel_hist_luma.setArg(1, H);
+	kernel_hist_luma.setArg(2, cl::Local(INT_BIN_SIZE * sizeof(int)));
+	kernel_hist_luma.setArg(3, (int)N);
+
+	queue.enqueueNDRangeKernel(kernel_hist_luma, cl::NullRange, cl::NDRange(((N + local_size - 1) / local_size) * local_size), cl::NDRange(local_size), wait_events, &prof_event);
+
+	return prof_event;
+}
+
+/* Enqueues the LUT remap B[i] = LUT[A[i]] over N pixels, vec_width pixels per work-item. */
+cl::Event enqueue_remap(cl::CommandQueue& queue, cl::Program& program, cl::Buffer& A, cl::Buffer& LUT, cl::Buffer& B, size_t N, int vec_width, const std::vector<cl::Event>* wait_events = NULL) {
+	cl::Event prof_event;
+
+	if (vec_width > 1) {
+		cl::Kernel kernel_lut_redirective = cl::Kernel(program, "LUT_redirective_vec");
+		kernel_lut_redirective.setArg(0, A);
+		kernel_lut_redirective.setArg(1, LUT);
+		kernel_lut_redirective.setArg(2, B);
+		kernel_lut_redirective.setArg(3, (int)N);
+
+		queue.enqueueNDRangeKernel(kernel_lut_redirective, cl::NullRange, cl::NDRange((N + vec_width - 1) / vec_width), cl::NullRange, wait_events, &prof_event);
+	}
+	else {
+		cl::Kernel kernel_lut_redirective = cl::Kernel(program, "LUT_redirective");
+		kernel_lut_redirective.setArg(0, A);
+		kernel_lut_redirective.setArg(1, LUT);
+		kernel_lut_redirective.setArg(2, B);
+
+		queue.enqueueNDRangeKernel(kernel_lut_redirective, cl::NullRange, cl::NDRange(N), cl::NullRange, wait_events, &prof_event);
+	}
+
+	return prof_event;
+}
+
+/* Enqueues convolve_tiled over a planar image of width x height x C from A to B, with the square mask of the given radius
+   in constant memory. Work-groups of 16x16 pixels (or fewer if the kernel or device requires) load their tile plus halo once. */
+cl::Event enqueue_convolution(cl::CommandQueue& queue, cl::Program& program, cl::Buffer& A, cl::Buffer& B, cl::Buffer& mask, int radius, int width, int height, int C, const std::vector<cl::Event>* wait_events = NULL) {
+	cl::Event prof_event;
+	cl::Kernel kernel_convolve = cl::Kernel(program, "convolve_tiled");
+
+	cl::Device device = queue.getInfo<CL_QUEUE_DEVICE>();
+	size_t group_side = 16;
+	while (group_side * group_side > kernel_convolve.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device)) { group_side /= 2; }
+
+	kernel_convolve.setArg(0, A);
+	kernel_convolve.setArg(1, B);
+	kernel_convolve.setArg(2, mask);
+	kernel_convolve.setArg(3, cl::Local((group_side + 2 * radius) * (group_side + 2 * radius)));
+	kernel_convolve.setArg(4, width);
+	kernel_convolve.setArg(5, height);
+	kernel_convolve.setArg(6, radius);
+
+	queue.enqueueNDRangeKernel(kernel_convolve, cl::NullRange,
+		cl::NDRange(((width + group_side - 1) / group_side) * group_side, ((height + group_side - 1) / group_side) * group_side, C),
+		cl::NDRange(group_side, group_side, 1), wait_events, &prof_event);
+
+	return prof_event;
+}
+
+/* Enqueues the two passes of a separable convolution of a planar image of width x height x C, from A through the float
+   buffer T (width * height * C floats) to B: convolve_rows on groups of 64x4 pixels, then convolve_columns on 16x16.
+   Returns the event of the column pass. */
+cl::Event enqueue_convolution_separable(cl::CommandQueue& queue, cl::Program& program, cl::Buffer& A, cl::Buffer& T, cl::Buffer& B,
+	cl::Buffer& row_weights, cl::Buffer& column_weights, int radius, int width, int height, int C, const std::vector<cl::Event>* wait_events = NULL) {
+	cl::Device device = queue.getInfo<CL_QUEUE_DEVICE>();
+	std::vector<cl::Event> rows_done(1);
+	cl::Event prof_event;
+
+	cl::Kernel kernel_rows = cl::Kernel(program, "convolve_rows");
+	size_t rows_x = 64, rows_y = 4;
+	while (rows_x * rows_y > kernel_rows.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device)) {
+		if (rows_y > 1) { rows_y /= 2; }
+		else { rows_x /= 2; }
+	}
+
+	kernel_rows.setArg(0, A);
+	kernel_rows.setArg(1, T);
+	kernel_rows.setArg(2, row_weights);
+	kernel_rows.setArg(3, cl::Local((rows_x + 2 * radius) * rows_y * sizeof(float)));
+	kernel_rows.setArg(4, width);
+	kernel_rows.setArg(5, height);
+	kernel_rows.setArg(6, radius);
+
+	queue.enqueueNDRangeKernel(kernel_rows, cl::NullRange,
+		cl::NDRange(((width + rows_x - 1) / rows_x) * rows_x, ((height + rows_y - 1) / rows_y) * rows_y, C),
+		cl::NDRange(rows_x, rows_y, 1), wait_events, &rows_done[0]);
+
+	cl::Kernel kernel_columns = cl::Kernel(program, "convolve_columns");
+	size_t group_side = 16;
+	while (group_side * group_side > kernel_columns.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device)) { group_side /= 2; }
+
+	kernel_columns.setArg(0, T);
+	kernel_columns.setArg(1, B);
+	kernel_columns.setArg(2, column_weights);
+	kernel_columns.setArg(3, cl::Local(group_side * (group_side + 2 * radius) * sizeof(float)));
+	kernel_columns.setArg(4, width);
+	kernel_columns.setArg(5, height);
+	kernel_columns.setArg(6, radius);
+
+	queue.enqueueNDRangeKernel(kernel_columns, cl::NullRange,
+		cl::NDRange(((width + group_side - 1) / group_side) * group_side, ((height + group_side - 1) / group_side) * group_side, C),
+		cl::NDRange(group_side, group_side, 1), &rows_done, &prof_event);
+
+	return prof_event;
+}
+
+/* Copies a planar 8-bit image of width x height x C from a buffer into the stacked planes of an image object. */
+cl::Event enqueue_copy_to_image(cl::CommandQueue& queue, cl::Buffer& A, cl::Image& image, int width, int height, int C, const std::vector<cl::Event>* wait_events = NULL) {
+	cl::Event prof_event;
+	queue.enqueueCopyBufferToImage(A, image, 0, { 0, 0, 0 }, { (size_t)width, (size_t)height * C, 1 }, wait_events, &prof_event);
+	return prof_event;
+}
+
+/* Enqueues convolve_image: like enqueue_convolution, with the input read from the stacked planes of image. */
+cl::Event enqueue_convolution_image(cl::CommandQueue& queue, cl::Program& program, cl::Image2D& image, cl::Buffer& B, cl::Buffer& mask, int radius, int width, int height, int C, const std::vector<cl::Event>* wait_events = NULL) {
+	cl::Event prof_event;
+	cl::Kernel kernel_convolve = cl::Kernel(program, "convolve_image");
+
+	kernel_convolve.setArg(0, image);
+	kernel_convolve.setArg(1, B);
+	kernel_convolve.setArg(2, mask);
+	kernel_convolve.setArg(3, width);
+	kernel_convolve.setArg(4, height);
+	kernel_convolve.setArg(5, radius);
+
+	queue.enqueueNDRangeKernel(kernel_convolve, cl::NullRange, cl::NDRange(width, height, C), cl::NullRange, wait_events, &prof_event);
+
+	return prof_event;
+}
+
+/* Enqueues LUT_redirective_image over every pixel of the stacked planes of image (width x rows). */
+cl::Event enqueue_remap_image(cl::CommandQueue& queue, cl::Program& program, cl::Image2D& image, cl::Buffer& LUT, cl::Buffer& B, int width, int rows, const std::vector<cl::Event>* wait_events = NULL) {
+	cl::Event prof_event;
+	cl::Kernel kernel_lut_redirective = cl::Kernel(program, "LUT_redirective_image");
+
+	kernel_lut_redirective.setArg(0, image);
+	kernel_lut_redirective.setArg(1, LUT);
+	kernel_lut_redirective.setArg(2, B);
+	kernel_lut_redirective.setArg(3, width);
+
+	queue.enqueueNDRangeKernel(kernel_lut_redirective, cl::NullRange, cl::NDRange(width, rows), cl::NullRange, wait_events, &prof_event);
+
+	return prof_event;
+}
+
+/* Enqueues hist_channels: the C histograms of nr_bins of a planar image of C x N pixels, back to back in H.
+   H must be zeroed beforehand. */
+cl::Event enqueue_histogram_channels(cl::CommandQueue& queue, cl::Program& program, cl::Buffer& image, cl::Buffer& H, size_t N, int C, int nr_bins, const std::vector<cl::Event>* wait_events = NULL) {
+	cl::Event prof_event;
+	cl::Kernel kernel_hist_channels = cl::Kernel(program, "hist_channels");
+
+	cl::Device device = queue.getInfo<CL_QUEUE_DEVICE>();
+	size_t local_size = std::min<size_t>(256, kernel_hist_channels.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device));
+
+	kernel_hist_channels.setArg(0, image);
+	kernel_hist_channels.setArg(1, H);
+	kernel_hist_channels.setArg(2, cl::Local(C * nr_bins * sizeof(int)));
+	kernel_hist_channels.setArg(3, nr_bins);
+	kernel_hist_channels.setArg(4, (int)N);
+	kernel_hist_channels.setArg(5, C);
+
+	queue.enqueueNDRangeKernel(kernel_hist_channels, cl::NullRange, cl::NDRange(((N + local_size - 1) / local_size) * local_size), cl::NDRange(local_size), wait_events, &prof_event);
+
+	return prof_event;
+}
+
+/* Pipeline settings taken from the command line. */
+struct EqualiseOptions {
+	string hist_kernel = "simple";
+	int hist_replicas = 8;
+	int vec_width = 0;
+	bool vec_width_given = false; //-w given, vec_width is otherwise resolved to the preferred width of the device
+	string scan_mode = "single";
+	size_t fused_max_pixels = FUSED_MAX_PIXELS;
+	string colour_mode = "luma";
+	string match_file; //histogram matching reference, an image or a text file of 256 bin counts; empty to equalise
+	int clahe_tiles_x = 0, clahe_tiles_y = 0; //CLAHE tile grid, 0 selects global equalisation
+	float clip_limit = 2.0f; //CLAHE clip limit as a multiple of the mean tile bin count, <= 0 disables clipping
+	bool dump_intermediates = false;
+	bool denoise = false; //convolve 8-bit input with the convolution mask before equalising
+	float blur_sigma = 0.0f; //denoise with a separable Gaussian of this sigma instead of the 3x3 box filter
+	int otsu_thresholds = 0; //threshold the output into otsu_thresholds + 1 levels (Otsu, multi-Otsu), 0 disables
+	bool auto_levels = false; //stretch between two percentiles instead of equalising
+	float levels_low = 1.0f, levels_high = 99.0f; //percentiles of auto_levels
+	string lut_mode = "auto"; //LUT arithmetic, double | fixed | auto (fixed on devices without cl_khr_fp64)
+	bool fixed_point_lut = false; //resolved from lut_mode once the device is known
+	bool use_images = false; //image objects for the convolution, remap and CLAHE interpolation kernels
+	bool channel_stats = false; //input statistics, and per-channel histograms and cumulative histograms of every 8-bit input
+	bool verbose = true; //print the per-stage kernel times
+};
+
+/* Splits a square mask of odd width into column and row vectors with mask(i, j) = column[i] * row[j], if it is rank 1
+   (within a small relative tolerance). The factors are read off the row and column of the largest coefficient. */
+bool separate_mask(const std::vector<float>& mask, std::vector<float>& column, std::vector<float>& row) {
+	int mask_width = (int)std::lround(std::sqrt((double)mask.size()));
+	size_t pivot = std::max_element(mask.begin(), mask.end(), [](float a, float b) { return std::fabs(a) < std::fabs(b); }) - mask.begin();
+	int pivot_row = (int)pivot / mask_width, pivot_column = (int)pivot % mask_width;
+
+	if ((mask_width * mask_width != (int)mask.size()) || (mask[pivot] == 0.0f)) { return false; }
+
+	column.resize(mask_width); row.resize(mask_width);
+	for (int i = 0; i < mask_width; i++) {
+		column[i] = mask[i * mask_width + pivot_column];
+		row[i] = mask[pivot_row * mask_width + i] / mask[pivot];
+	}
+
+	for (int i = 0; i < mask_width; i++) {
+		for (int j = 0; j < mask_width; j++) {
+			if (std::fabs(mask[i * mask_width + j] - column[i] * row[j]) > 1e-5f * std::fabs(mask[pivot])) { return false; }
+		}
+	}
+
+	return true;
+}
+
+/* Normalised 1D Gaussian of the given sigma, radius ceil(3 * sigma): sigma 2.5 gives the 15-tap and sigma 5 the 31-tap kernel. */
+std::vector<float> gaussian_weights(float sigma) {
+	int radius = std::max(1, (int)std::ceil(3.0f * sigma));
+	std::vector<float> weights(2 * radius + 1);
+
+	for (int i = -radius; i <= radius; i++) { weights[i + radius] = std::exp(-0.5f * i * i / (sigma * sigma)); }
+
+	float sum = std::accumulate(weights.begin(), weights.end(), 0.0f);
+	for (float& weight : weights) { weight /= sum; }
+
+	return weights;
+}
+
+/* Device buffers of the equalisation pipeline. The buffers only grow, so a batch of images of equal
+   or smaller size (in bytes and in bins) runs without any new allocation. */
+struct EqualiseBuffers {
+	cl::Context context;
+	size_t capacity = 0;
+	int bin_capacity = 0;
+
+	cl::Buffer image_input, image_output;
+	cl::Buffer hist, hist_cumulative, lut;
+	cl::Buffer lut_compact; //8-bit equalisation LUT, 256 uchar
+	cl::Buffer level_fractions, level_bins; //auto-levels, the low and high quantiles and the bins found for them
+	cl::Buffer otsu_hist, otsu_cumulative, otsu_moments; //Otsu, histogram of the remapped image, its scan and moment scan
+	cl::Buffer otsu_values, otsu_codes, otsu_thresholds; //Otsu, best candidate of each search group, thresholds found
+	int otsu_bin_capacity = 0;
+	size_t otsu_group_capacity = 0;
+	cl::Buffer reference_cumulative; //histogram matching, inclusive cumulative histogram of the reference
+	cl::Buffer tile_luts; //CLAHE, 256 uchar per tile and channel
+	size_t tile_lut_capacity = 0;
+	cl::Buffer image_filtered; //denoised input, same size as image_input
+	size_t filtered_capacity = 0;
+	cl::Buffer convolution_mask; //(2 * mask_radius + 1)^2 floats
+	int mask_radius = 0;
+	bool separable = false; //convolve with row_weights then column_weights instead of convolution_mask
+	cl::Buffer row_weights, column_weights; //2 * mask_radius + 1 floats each
+	cl::Buffer image_rows; //float result of the row pass
+	size_t rows_capacity = 0;
+	cl::Image2D image_2d; //image back end, copy of the pipeline input with the channel planes stacked vertically
+	size_t image_2d_width = 0, image_2d_height = 0;
+	cl::Image3D tile_lut_image; //image back end, CLAHE LUTs as tiles_x x tiles_y x (256 * channels)
+	size_t tile_lut_image_size[3] = { 0, 0, 0 };
+
+	StatsEngine stats; //image statistics of image_input
+
+	EqualiseBuffers(cl::Context& context, const string& cache_dir = "") : context(context), stats(context, "kernels/stats_generic.cl", cache_dir) {}
+
+	void reserve(size_t size, int nr_bins = INT_BIN_SIZE) {
+		if (size > capacity) {
+			image_input = cl::Buffer(context, CL_MEM_READ_ONLY, size);
+			image_output = cl::Buffer(context, CL_MEM_READ_WRITE, size); //should be the same as input image
+			capacity = size;
+		}
+
+		if (nr_bins > bin_capacity) {
+			hist = cl::Buffer(context, CL_MEM_READ_WRITE, nr_bins * sizeof(int));
+			hist_cumulative = cl::Buffer(context, CL_MEM_READ_WRITE, nr_bins * sizeof(int));
+			lut = cl::Buffer(context, CL_MEM_READ_WRITE, nr_bins * sizeof(int));
+			bin_capacity = nr_bins;
+		}
+
+		if (!lut_compact()) { lut_compact = cl::Buffer(context, CL_MEM_READ_WRITE, INT_BIN_SIZE); }
+	}
+
+	void reserve_filtered(size_t size) {
+		if (size > filtered_capacity) {
+			image_filtered = cl::Buffer(context, CL_MEM_READ_WRITE, size);
+			filtered_capacity = size;
+		}
+
+		if (separable && (size > rows_capacity)) {
+			image_rows = cl::Buffer(context, CL_MEM_READ_WRITE, size * sizeof(float));
+			rows_capacity = size;
+		}
+	}
+
+	/* Uploads a square mask of odd width, used by every convolution until the next call. Rank-1 masks of radius
+	   SEPARABLE_MIN_RADIUS and above are uploaded as their row and column factors and run as two 1D passes. */
+	void set_mask(const std::vector<float>& mask) {
+		std::vector<float> column, row;
+		int mask_width = (int)std::lround(std::sqrt((double)mask.size()));
+
+		if ((mask_width / 2 >= SEPARABLE_MIN_RADIUS) && separate_mask(mask, column, row)) {
+			set_separable(column, row);
+			return;
+		}
+
+		mask_radius = mask_width / 2;
+		separable = false;
+		convolution_mask = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, mask.size() * sizeof(float), (void*)mask.data());
+	}
+
+	/* Uploads the factors of a separable mask, column * row, both of the same odd length. */
+	void set_separable(const std::vector<float>& column, const std::vector<float>& row) {
+		mask_radius = (int)row.size() / 2;
+		separable = true;
+		row_weights = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, row.size() * sizeof(float), (void*)row.data());
+		column_weights = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, column.size() * sizeof(float), (void*)column.data());
+		rows_capacity = 0;
+	}
+
+	/* Stores the auto-levels quantiles (percent) on the device for every following image. */
+	void set_levels(float low_percent, float high_percent) {
+		cl_int fractions[2] = { (cl_int)std::lround(low_percent / 100.0 * QUANTILE_ONE), (cl_int)std::lround(high_percent / 100.0 * QUANTILE_ONE) };
+		level_fractions = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(fractions), fractions);
+		level_bins = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(fractions));
+	}
+
+	void reserve_otsu(int nr_bins, size_t nr_groups) {
+		if (nr_bins > otsu_bin_capacity) {
+			otsu_hist = cl::Buffer(context, CL_MEM_READ_WRITE, nr_bins * sizeof(int));
+			otsu_cumulative = cl::Buffer(context, CL_MEM_READ_WRITE, nr_bins * sizeof(int));
+			otsu_moments = cl::Buffer(context, CL_MEM_READ_WRITE, nr_bins * sizeof(cl_long));
+			otsu_thresholds = cl::Buffer(context, CL_MEM_READ_WRITE, 4 * sizeof(int));
+			otsu_bin_capacity = nr_bins;
+		}
+
+		if (nr_groups > otsu_group_capacity) {
+			otsu_values = cl::Buffer(context, CL_MEM_READ_WRITE, nr_groups * sizeof(cl_double)); //double or float scores, see otsu_score
+			otsu_codes = cl::Buffer(context, CL_MEM_READ_WRITE, nr_groups * sizeof(cl_long));
+			otsu_group_capacity = nr_groups;
+		}
+	}
+
+	/* Images cannot be used partially like the buffers, so these are reallocated whenever the size changes. */
+	void reserve_image(size_t width, size_t height) {
+		if ((width != image_2d_width) || (height != image_2d_height)) {
+			image_2d = cl::Image2D(context, CL_MEM_READ_ONLY, cl::ImageFormat(CL_R, CL_UNORM_INT8), width, height);
+			image_2d_width = width; image_2d_height = height;
+		}
+	}
+
+	/* True if an image of width x rows (the planes stacked vertically) and, for a tiles_x x tiles_y CLAHE grid, the LUT
+	   volume of depth slices are within the image size limits of the device. */
+	bool images_fit(size_t width, size_t rows, size_t tiles_x = 0, size_t tiles_y = 0, size_t depth = 0) {
+		cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+
+		if ((width > device.getInfo<CL_DEVICE_IMAGE2D_MAX_WIDTH>()) || (rows > device.getInfo<CL_DEVICE_IMAGE2D_MAX_HEIGHT>())) { return false; }
+
+		return (tiles_x == 0) || ((tiles_x <= device.getInfo<CL_DEVICE_IMAGE3D_MAX_WIDTH>()) && (tiles_y <= device.getInfo<CL_DEVICE_IMAGE3D_MAX_HEIGHT>())
+			&& (depth <= device.getInfo<CL_DEVICE_IMAGE3D_MAX_DEPTH>()));
+	}
+
+	void reserve_tile_image(size_t tiles_x, size_t tiles_y, size_t depth) {
+		if ((tiles_x != tile_lut_image_size[0]) || (tiles_y != tile_lut_image_size[1]) || (depth != tile_lut_image_size[2])) {
+			tile_lut_image = cl::Image3D(context, CL_MEM_READ_ONLY, cl::ImageFormat(CL_R, CL_UNORM_INT8), tiles_x, tiles_y, depth);
+			tile_lut_image_size[0] = tiles_x; tile_lut_image_size[1] = tiles_y; tile_lut_image_size[2] = depth;
+		}
+	}
+
+	void reserve_tiles(size_t nr_tiles) {
+		if (nr_tiles > tile_lut_capacity) {
+			tile_luts = cl::Buffer(context, CL_MEM_READ_WRITE, nr_tiles * INT_BIN_SIZE);
+			tile_lut_capacity = nr_tiles;
+		}
+	}
+};
+
+/* Enqueues the Otsu thresholding stage on top of a LUT stage, from buffers.hist and buffers.lut: the histogram of
+   the remapped image (hist_remap), its count and moment scans, the search for the nr_thresholds (1-4) thresholds
+   maximising the between-class variance (otsu_search, otsu_select, into buffers.otsu_thresholds) and LUT_threshold,
+   which replaces buffers.lut in place by the class levels. Nothing is read back. More than one threshold is
+   limited to 256 bins, the search grows with nr_bins^nr_thresholds. Returns the event of the LUT kernel. */
+cl::Event enqueue_otsu(cl::CommandQueue& queue, cl::Program& program, EqualiseBuffers& buffers, int nr_bins, int nr_thresholds, const std::vector<cl::Event>* wait_events = NULL) {
+	if ((nr_thresholds < 1) || (nr_thresholds > 4) || ((nr_thresholds > 1) && (nr_bins > INT_BIN_SIZE))) {
+		throw cl::Error(CL_INVALID_VALUE, "enqueue_otsu: 1 threshold, or 2-4 thresholds on up to 256 bins");
+	}
+
+	cl::Kernel kernel_remap = cl::Kernel(program, "hist_remap");
+	cl::Kernel kernel_moments = cl::Kernel(program, "hist_moments");
+	cl::Kernel kernel_search = cl::Kernel(program, "otsu_search");
+	cl::Kernel kernel_select = cl::Kernel(program, "otsu_select");
+	cl::Kernel kernel_threshold = cl::Kernel(program, "LUT_threshold");
+
+	//power-of-two work-groups for the tree reductions and the moment scan
+	cl::Device device = queue.getInfo<CL_QUEUE_DEVICE>();
+	size_t local_size = std::min({ PowerOfTwoLocalSize(kernel_search, device), PowerOfTwoLocalSize(kernel_select, device), PowerOfTwoLocalSize(kernel_moments, device) });
+
+	size_t candidates = (nr_thresholds == 1) ? nr_bins : (size_t)nr_bins * nr_bins;
+	size_t nr_groups = (candidates + local_size - 1) / local_size;
+
+	buffers.reserve_otsu(nr_bins, nr_groups);
+
+	/* Histogram of the remapped image -> straight from the histogram and the LUT, the pixels are not read again */
+	std::vector<cl::Event> stage(wait_events ? *wait_events : std::vector<cl::Event>());
+	stage.push_back(cl::Event());
+	queue.enqueueFillBuffer(buffers.otsu_hist, 0, 0, nr_bins * sizeof(int), NULL, &stage.back());
+
+	kernel_remap.setArg(0, buffers.hist);
+	kernel_remap.setArg(1, buffers.lut);
+	kernel_remap.setArg(2, buffers.otsu_hist);
+
+	cl::Event remapped;
+	queue.enqueueNDRangeKernel(kernel_remap, cl::NullRange, cl::NDRange(nr_bins), cl::NullRange, &stage, &remapped);
+	stage.assign(1, remapped);
+
+	/* Class counts and moments -> inclusive scans, independent of each other */
+	std::vector<cl::Event> scanned(1, enqueue_cumulative(queue, program, buffers.otsu_hist, buffers.otsu_cumulative, nr_bins, true, &stage));
+
+	kernel_moments.setArg(0, buffers.otsu_hist);
+	kernel_moments.setArg(1, buffers.otsu_moments);
+	kernel_moments.setArg(2, cl::Local(local_size * sizeof(cl_long)));
+	kernel_moments.setArg(3, nr_bins);
+
+	scanned.push_back(cl::Event());
+	queue.enqueueNDRangeKernel(kernel_moments, cl::NullRange, cl::NDRange(local_size), cl::NDRange(local_size), &stage, &scanned.back());
+
+	/* Search -> one work-item per candidate (first two thresholds), best per group, then best overall */
+	kernel_search.setArg(0, buffers.otsu_cumulative);
+	kernel_search.setArg(1, buffers.otsu_moments);
+	kernel_search.setArg(2, buffers.otsu_values);
+	kernel_search.setArg(3, buffers.otsu_codes);
+	kernel_search.setArg(4, cl::Local(local_size * sizeof(cl_double)));
+	kernel_search.setArg(5, cl::Local(local_size * sizeof(cl_long)));
+	kernel_search.setArg(6, nr_bins);
+	kernel_search.setArg(7, nr_thresholds);
+
+	queue.enqueueNDRangeKernel(kernel_search, cl::NullRange, cl::NDRange(nr_groups * local_size), cl::NDRange(local_size), &scanned, &stage[0]);
+
+	kernel_select.setArg(0, buffers.otsu_values);
+	kernel_select.setArg(1, buffers.otsu_codes);
+	kernel_select.setArg(2, buffers.otsu_thresholds);
+	kernel_select.setArg(3, cl::Local(local_size * sizeof(cl_double)));
+	kernel_select.setArg(4, cl::Local(local_size * sizeof(cl_long)));
+	kernel_select.setArg(5, (int)nr_groups);
+	kernel_select.setArg(6, nr_bins);
+	kernel_select.setArg(7, nr_thresholds);
+
+	cl::Event selected;
+	queue.enqueueNDRangeKernel(kernel_select, cl::NullRange, cl::NDRange(local_size), cl::NDRange(local_size), &stage, &selected);
+	stage[0] = selected;
+
+	/* Thresholding -> composed with the LUT of the previous stage, so a single remap applies both */
+	kernel_threshold.setArg(0, buffers.otsu_thresholds);
+	kernel_threshold.setArg(1, buffers.lut);
+	kernel_threshold.setArg(2, nr_bins);
+	kernel_threshold.setArg(3, nr_thresholds);
+
+	cl::Event prof_event;
+	queue.enqueueNDRangeKernel(kernel_threshold, cl::NullRange, cl::NDRange(nr_bins), cl::NullRange, &stage, &prof_event);
+
+	return prof_event;
+}
+
+/* Largest value a PGM/PPM file declares in its header (255 for 8-bit data, up to 65535 for 16-bit), 0 if unreadable. */
+int pnm_max_value(const string& file_name) {
+	ifstream file(file_name, ios::binary);
+	string magic;
+	int fields[3];
+
+	if (!(file >> magic) || (magic.size() != 2) || (magic[0] != 'P')) { return 0; }
+
+	for (int& field : fields) {
+		file >> std::ws;
+		while (file.peek() == '#') {
+			string comment;
+			std::getline(file, comment);
+			file >> std::ws;
+		}
+		if (!(file >> field)) { return 0; }
+	}
+
+	return fields[2];
+}
+
+/* Uploads an 8-bit image to buffers.image_input and, with options.denoise, convolves it on the device into
+   buffers.image_filtered. Returns the buffer the pipeline should read; ready completes once it holds the pixels.
+   With options.use_images and read_image, buffers.image_2d holds a copy of the same pixels when ready completes;
+   callers whose kernels only read buffers pass read_image = false and skip the copy. */
+cl::Buffer& upload_image(cl::CommandQueue& queue, cl::Program& program, const EqualiseOptions& options, EqualiseBuffers& buffers,
+	const CImg<unsigned char>& image_input, cl::Event& ready, bool read_image = true) {
+	int width = image_input.width(), height = image_input.height() * image_input.depth(), C = image_input.spectrum();
+	bool image_output = options.use_images && read_image;
+	bool image_convolution = options.use_images && options.denoise && !buffers.separable;
+
+	queue.enqueueWriteBuffer(buffers.image_input, CL_FALSE, 0, image_input.size(), image_input.data(), NULL, &ready);
+
+	if (image_output || image_convolution) { buffers.reserve_image(width, (size_t)height * C); }
+
+	std::vector<cl::Event> upload(1, ready);
+
+	//the 2D image convolution reads the upload through the image
+	if (image_convolution || (image_output && !options.denoise)) {
+		ready = enqueue_copy_to_image(queue, buffers.image_input, buffers.image_2d, width, height, C, &upload);
+		upload[0] = ready;
+	}
+
+	if (!options.denoise) { return buffers.image_input; }
+
+	buffers.reserve_filtered(image_input.size());
+
+	if (buffers.separable) {
+		ready = enqueue_convolution_separable(queue, program, buffers.image_input, buffers.image_rows, buffers.image_filtered, buffers.row_weights, buffers.column_weights,
+			buffers.mask_radius, width, height, C, &upload);
+	}
+	else if (options.use_images) {
+		ready = enqueue_convolution_image(queue, program, buffers.image_2d, buffers.image_filtered, buffers.convolution_mask, buffers.mask_radius, width, height, C, &upload);
+	}
+	else {
+		ready = enqueue_convolution(queue, program, buffers.image_input, buffers.image_filtered, buffers.convolution_mask, buffers.mask_radius, width, height, C, &upload);
+	}
+
+	if (image_output) {
+		upload[0] = ready;
+		ready = enqueue_copy_to_image(queue, buffers.image_filtered, buffers.image_2d, width, height, C, &upload);
+	}
+
+	return buffers.image_filtered;
+}
+
+/* Equalises the luminance of one planar 8-bit RGB image into output_buffer: luma histogram, scan and LUT, then a remap
+   that shifts R, G and B by the change of their luma. Two passes over the pixels like the grey pipeline, all chained on the device. */
+void equalise_image_colour(cl::CommandQueue& queue, cl::Program& program, const EqualiseOptions& options, EqualiseBuffers& buffers,
+	const CImg<unsigned char>& image_input, vector<unsigned char>& output_buffer) {
+	//the luma histogram has a kernel of its own, the -k and -w variants only exist for single-channel histograms
+	if ((options.hist_kernel != "simple") || options.vec_width_given) {
+		throw cl::Error(CL_INVALID_VALUE, "equalise_image_colour: -k and -w need grey input or -c joint");
+	}
+
+	size_t N = (size_t)image_input.width() * image_input.height() * image_input.depth();
+
+	buffers.reserve(image_input.size(), INT_BIN_SIZE);
+
+	//the luma kernels read buffers only, the image copy of the upload is skipped
+	std::vector<cl::Event> stage(2);
+	cl::Buffer& source = upload_image(queue, program, options, buffers, image_input, stage[0], false);
+	queue.enqueueFillBuffer(buffers.hist, 0, 0, INT_BIN_SIZE * sizeof(int), NULL, &stage[1]);
+
+	/* Luma histogram -> Y computed on the fly, never stored */
+	cl::Event prof_event_hist = enqueue_histogram_luma(queue, program, source, buffers.hist, N, &stage);
+	stage.assign(1, prof_event_hist);
+
+	cl::Event prof_event_cumulative;
+	if (options.scan_mode == "single") {
+		prof_event_cumulative = enqueue_cumulative(queue, program, buffers.hist, buffers.hist_cumulative, INT_BIN_SIZE, true, &stage);
+	}
+	else {
+		prof_event_cumulative = EnqueueScan(queue, program, buffers.hist, buffers.hist_cumulative, INT_BIN_SIZE, true, (options.scan_mode == "lookback") ? SCAN_LOOKBACK : SCAN_HIERARCHICAL, &stage);
+	}
+	stage[0] = prof_event_cumulative;
+
+	cl::Event prof_event_lut;
+	if (options.auto_levels) { prof_event_lut = enqueue_lut_levels(queue, program, buffers.hist_cumulative, buffers.level_fractions, buffers.level_bins, buffers.lut, INT_BIN_SIZE, &stage); }
+	else if (!options.match_file.empty()) { prof_event_lut = enqueue_lut_match(queue, program, buffers.hist_cumulative, buffers.reference_cumulative, buffers.lut, INT_BIN_SIZE, &stage); }
+	else { prof_event_lut = enqueue_lut(queue, program, buffers.hist_cumulative, buffers.lut, INT_BIN_SIZE, &stage, options.fixed_point_lut); }
+	stage[0] = prof_event_lut;
+
+	/* Binarisation -> Otsu thresholds of the remapped luma histogram, folded into the LUT */
+	cl::Event prof_event_otsu;
+	if (options.otsu_thresholds > 0) {
+		prof_event_otsu = enqueue_otsu(queue, program, buffers, INT_BIN_SIZE, options.otsu_thresholds, &stage);
+		stage[0] = prof_event_otsu;
+	}
+
+	/* YCbCr -> RGB with the equalised Y, or the thresholded Y on all channels */
+	cl::Kernel kernel_remap = cl::Kernel(program, "LUT_redirective_luma");
+	kernel_remap.setArg(0, source);
+	kernel_remap.setArg(1, buffers.lut);
+	kernel_remap.setArg(2, buffers.image_output);
+	kernel_remap.setArg(3, (int)N);
+	kernel_remap.setArg(4, (int)(options.otsu_thresholds > 0));
+
+	cl::Event prof_event_remap;
+	queue.enqueueNDRangeKernel(kernel_remap, cl::NullRange, cl::NDRange(N), cl::NullRange, &stage, &prof_event_remap);
+	stage[0] = prof_event_remap;
+
+	/* Intermediate results are only copied back on request */
+	std::vector<int> H_bin, CH_bin, LUT_table;
+	if (options.dump_intermediates) {
+		H_bin.resize(INT_BIN_SIZE); CH_bin.resize(INT_BIN_SIZE); LUT_table.resize(INT_BIN_SIZE);
+		queue.enqueueReadBuffer(buffers.hist, CL_FALSE, 0, INT_BIN_SIZE * sizeof(int), &H_bin[0], &stage);
+		queue.enqueueReadBuffer(buffers.hist_cumulative, CL_FALSE, 0, INT_BIN_SIZE * sizeof(int), &CH_bin[0], &stage);
+		queue.enqueueReadBuffer(buffers.lut, CL_FALSE, 0, INT_BIN_SIZE * sizeof(int), &LUT_table[0], &stage);
+	}
+
+	queue.enqueueReadBuffer(buffers.image_output, CL_TRUE, 0, image_input.size(), &output_buffer.data()[0], &stage);
+	queue.finish();
+
+	if (!options.verbose) { return; }
+
+	std::cout << "Histogram [luma] : ";
+	if (options.dump_intermediates) { std::cout << H_bin << "\t"; }
+	std::cout << "kernel exec. time in ns: " << prof_event_hist.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event_hist.getProfilingInfo<CL_PROFILING_COMMAND_START>() << "\n";
+	std::cout << "Histogram [cumulative] : ";
+	if (options.dump_intermediates) { std::cout << CH_bin << "\t"; }
+	std::cout << "kernel exec. time in ns: " << prof_event_cumulative.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event_cumulative.getProfilingInfo<CL_PROFILING_COMMAND_START>() << "\n";
+	std::cout << "Histogram [normalised & LUT] : ";
+	if (options.dump_intermediates) { std::cout << LUT_table << "\t"; }
+	std::cout << "kernel exec. time in ns: " << prof_event_lut.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event_lut.getProfilingInfo<CL_PROFILING_COMMAND_START>() << "\n";
+	if (options.otsu_thresholds > 0) {
+		std::vector<int> thresholds(options.otsu_thresholds);
+		queue.enqueueReadBuffer(buffers.otsu_thresholds, CL_TRUE, 0, thresholds.size() * sizeof(int), &thresholds[0]);
+		std::cout << "Otsu thresholds " << thresholds << " : threshold LUT kernel exec. time in ns: " << prof_event_otsu.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event_otsu.getProfilingInfo<CL_PROFILING_COMMAND_START>() << "\n";
+	}
+	std::cout << "LUT [redirective, luma] : kernel exec. time in ns: " << prof_event_remap.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event_remap.getProfilingInfo<CL_PROFILING_COMMAND_START>() << "\n";
+}
+
+/* CLAHE of one 8-bit image (every channel on its own) into output_buffer: clahe_tile_lut builds the clipped
+   histogram and LUT of every tile in local memory, one work-group per tile, then clahe_remap blends the LUTs
+   of the four nearest tiles per pixel. Both launches are chained on the device. */
+void equalise_image_clahe(cl::CommandQueue& queue, cl::Program& program, const EqualiseOptions& options, EqualiseBuffers& buffers,
+	const CImg<unsigned char>& image_input, vector<unsigned char>& output_buffer) {
+	int width = image_input.width(), height = image_input.height() * image_input.depth(), C = image_input.spectrum();
+	int tiles_x = std::min(options.clahe_tiles_x, width), tiles_y = std::min(options.clahe_tiles_y, height);
+	cl::Device device = queue.getInfo<CL_QUEUE_DEVICE>();
+
+	buffers.reserve(image_input.size());
+	buffers.reserve_tiles((size_t)tiles_x * tiles_y * C);
+
+	std::vector<cl::Event> stage(1);
+	cl::Buffer& source = upload_image(queue, program, options, buffers, image_input, stage[0]);
+
+	/* Tile LUTs -> power-of-two work-groups of up to 256 work-items, one per tile and channel */
+	cl::Kernel kernel_tile_lut = cl::Kernel(program, "clahe_tile_lut");
+	size_t local_size = PowerOfTwoLocalSize(kernel_tile_lut, device, INT_BIN_SIZE);
+
+	kernel_tile_lut.setArg(0, source);
+	kernel_tile_lut.setArg(1, buffers.tile_luts);
+	kernel_tile_lut.setArg(2, cl::Local(INT_BIN_SIZE * sizeof(int)));
+	kernel_tile_lut.setArg(3, cl::Local(local_size * sizeof(int)));
+	kernel_tile_lut.setArg(4, width);
+	kernel_tile_lut.setArg(5, height);
+	kernel_tile_lut.setArg(6, options.clip_limit);
+
+	cl::Event prof_event_tiles;
+	queue.enqueueNDRangeKernel(kernel_tile_lut, cl::NullRange, cl::NDRange(tiles_x * local_size, tiles_y, C), cl::NDRange(local_size, 1, 1), &stage, &prof_event_tiles);
+	stage[0] = prof_event_tiles;
+
+	/* Bilinear remap -> one work-item per pixel, blended by the sampler from a 3D image of the LUTs with the image back end */
+	cl::Kernel kernel_remap;
+	if (options.use_images) {
+		buffers.reserve_tile_image(tiles_x, tiles_y, (size_t)INT_BIN_SIZE * C);
+		cl::Event copied;
+		queue.enqueueCopyBufferToImage(buffers.tile_luts, buffers.tile_lut_image, 0, { 0, 0, 0 }, { (size_t)tiles_x, (size_t)tiles_y, (size_t)INT_BIN_SIZE * C }, &stage, &copied);
+		stage[0] = copied;
+
+		kernel_remap = cl::Kernel(program, "clahe_remap_image");
+		kernel_remap.setArg(0, buffers.image_2d);
+		kernel_remap.setArg(1, buffers.tile_lut_image);
+	}
+	else {
+		kernel_remap = cl::Kernel(program, "clahe_remap");
+		kernel_remap.setArg(0, source);
+		kernel_remap.setArg(1, buffers.tile_luts);
+	}
+	kernel_remap.setArg(2, buffers.image_output);
+	kernel_remap.setArg(3, width);
+	kernel_remap.setArg(4, height);
+	kernel_remap.setArg(5, tiles_x);
+	kernel_remap.setArg(6, tiles_y);
+
+	cl::Event prof_event_remap;
+	queue.enqueueNDRangeKernel(kernel_remap, cl::NullRange, cl::NDRange(width, height, C), cl::NullRange, &stage, &prof_event_remap);
+	stage[0] = prof_event_remap;
+
+	queue.enqueueReadBuffer(buffers.image_output, CL_TRUE, 0, image_input.size(), &output_buffer.data()[0], &stage);
+
+	if (!options.verbose) { return; }
+
+	std::cout << "CLAHE [" << tiles_x << "x" << tiles_y << " tiles, clip " << options.clip_limit << "] : kernel exec. time in ns: " << prof_event_tiles.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event_tiles.getProfilingInfo<CL_PROFILING_COMMAND_START>() << "\n";
+	std::cout << "CLAHE [bilinear remap] : kernel exec. time in ns: " << prof_event_remap.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event_remap.getProfilingInfo<CL_PROFILING_COMMAND_START>() << "\n";
+}
+
+/* Equalises one 8-bit image into output_buffer (image_input.size() bytes). The stages are chained on the
+   device with event wait lists and only the output image is read back, unless dump_intermediates is set. */
+void equalise_image(cl::CommandQueue& queue, cl::Program& program, const EqualiseOptions& options, EqualiseBuffers& buffers,
+	const CImg<unsigned char>& image_input, vector<unsigned char>& output_buffer) {
+	/* Image back end -> buffers for this image if its planes (or CLAHE LUTs) exceed the image size limits */
+	if (options.use_images && !buffers.images_fit(image_input.width(), (size_t)image_input.height() * image_input.depth() * image_input.spectrum(),
+		std::max(options.clahe_tiles_x, 0), std::max(options.clahe_tiles_y, 0), (size_t)INT_BIN_SIZE * image_input.spectrum())) {
+		EqualiseOptions buffer_options = options;
+		buffer_options.use_images = false;
+		if (options.verbose) { std::cout << "The image exceeds the device image size limits, using buffers" << std::endl; }
+
+		equalise_image(queue, program, buffer_options, buffers, image_input, output_buffer);
+		return;
+	}
+
+	/* Adaptive equalisation -> per-tile LUTs instead of one global LUT */
+	if (options.clahe_tiles_x > 0) {
+		equalise_image_clahe(queue, program, options, buffers, image_input, output_buffer);
+		return;
+	}
+
+	/* Colour input -> equalise the luminance only, unless one joint histogram of all channels was asked for */
+	if ((image_input.spectrum() == 3) && (options.colour_mode == "luma")) {
+		equalise_image_colour(queue, program, options, buffers, image_input, output_buffer);
+		return;
+	}
+
+	typedef int custom_int; std::vector<custom_int> H_bin(INT_BIN_SIZE);
+	std::vector<custom_int> CH_bin(INT_BIN_SIZE);
+	size_t h_size = H_bin.size() * sizeof(custom_int);
+
+	std::vector<custom_int> LUT_table(INT_BIN_SIZE);
+	std::vector<unsigned char> LUT_compact(INT_BIN_SIZE);
+
+	buffers.reserve(image_input.size(), INT_BIN_SIZE);
+
+	/* Events to measure the execution times. */
+	cl::Event prof_event_simple;
+
+	cl::Event prof_event_cumulative;
+
+	cl::Event prof_event_lut;
+
+	cl::Event prof_event_redirective;
+
+	//4.1 Copy images to device memory
+	std::vector<cl::Event> upload(1);
+	cl::Buffer& source = upload_image(queue, program, options, buffers, image_input, upload[0]);
+
+	/* The intermediates of the fused kernel stay in local memory, so dumping them needs the staged path */
+	size_t nr_pixels = (size_t)image_input.width() * image_input.height() * image_input.depth();
+
+	if ((nr_pixels <= options.fused_max_pixels) && options.match_file.empty() && !options.auto_levels && (options.otsu_thresholds == 0) && !options.dump_intermediates) {
+		/* Small images -> histogram, scan, LUT and remap in a single launch */
+		std::vector<cl::Event> fused(1, enqueue_equalise_fused(queue, program, source, buffers.image_output, image_input.size(), &upload));
+		cl::Event prof_event_fused = fused[0];
+		queue.enqueueReadBuffer(buffers.image_output, CL_TRUE, 0, image_input.size(), &output_buffer.data()[0], &fused);
+
+		if (options.verbose) {
+			std::cout << "Equalisation [fused] : kernel exec. time in ns: " << prof_event_fused.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event_fused.getProfilingInfo<CL_PROFILING_COMMAND_START>() << "\n";
+		}
+		return;
+	}
+
+	//4.2 Setup and execute the kernel (i.e. device code)
+	//each stage waits on the event of the previous one, nothing comes back to the host until the output image
+	std::vector<cl::Event> stage(2);
+	stage[0] = upload[0];
+	queue.enqueueFillBuffer(buffers.hist, 0, 0, h_size, NULL, &stage[1]);
+
+	/* This line uses Intensity Histogram to describe the distribution of the frequency of each pixel from 0 to 255. */
+	prof_event_simple = enqueue_histogram(queue, program, options.hist_kernel, source, buffers.hist, image_input.size(), (int)H_bin.size(), options.hist_replicas, options.vec_width, &stage);
+	stage.assign(1, prof_event_simple);
+
+	/* Cumulative Histogram -> inclusive scan of the histogram bins */
+	if (options.scan_mode == "single") {
+		prof_event_cumulative = enqueue_cumulative(queue, program, buffers.hist, buffers.hist_cumulative, (int)H_bin.size(), true, &stage);
+	}
+	else {
+		prof_event_cumulative = EnqueueScan(queue, program, buffers.hist, buffers.hist_cumulative, H_bin.size(), true, (options.scan_mode == "lookback") ? SCAN_LOOKBACK : SCAN_HIERARCHICAL, &stage);
+	}
+	stage[0] = prof_event_cumulative;
+
+	/* LUT -> one work-item per bin, equalising, stretching between two quantiles or matching the reference histogram.
+	   The plain buffer equalisation uses the compact uchar LUT, held in local memory by the remap. */
+	bool compact = options.match_file.empty() && !options.auto_levels && (options.otsu_thresholds == 0) && !options.use_images;
+
+	if (options.auto_levels) {
+		prof_event_lut = enqueue_lut_levels(queue, program, buffers.hist_cumulative, buffers.level_fractions, buffers.level_bins, buffers.lut, (int)LUT_table.size(), &stage);
+	}
+	else if (compact) {
+		prof_event_lut = enqueue_lut_compact(queue, program, buffers.hist_cumulative, buffers.lut_compact, (int)LUT_table.size(), &stage, options.fixed_point_lut);
+	}
+	else if (options.match_file.empty()) {
+		prof_event_lut = enqueue_lut(queue, program, buffers.hist_cumulative, buffers.lut, (int)LUT_table.size(), &stage, options.fixed_point_lut);
+	}
+	else {
+		prof_event_lut = enqueue_lut_match(queue, program, buffers.hist_cumulative, buffers.reference_cumulative, buffers.lut, (int)LUT_table.size(), &stage);
+	}
+	stage[0] = prof_event_lut;
+
+	/* Binarisation -> Otsu thresholds of the remapped histogram, folded into the LUT */
+	cl::Event prof_event_otsu;
+	if (options.otsu_thresholds > 0) {
+		prof_event_otsu = enqueue_otsu(queue, program, buffers, (int)LUT_table.size(), options.otsu_thresholds, &stage);
+		stage[0] = prof_event_otsu;
+	}
+
+	/* Redirective LUT */
+	if (options.use_images) {
+		prof_event_redirective = enqueue_remap_image(queue, program, buffers.image_2d, buffers.lut, buffers.image_output, image_input.width(), (int)(image_input.size() / image_input.width()), &stage);
+	}
+	else if (compact) {
+		prof_event_redirective = enqueue_remap_compact(queue, program, source, buffers.lut_compact, buffers.image_output, image_input.size(), options.vec_width, &stage);
+	}
+	else {
+		prof_event_redirective = enqueue_remap(queue, program, source, buffers.lut, buffers.image_output, image_input.size(), options.vec_width, &stage);
+	}
+	stage[0] = prof_event_redirective;
+
+	/* Intermediate results are only copied back on request */
+	if (options.dump_intermediates) {
+		queue.enqueueReadBuffer(buffers.hist, CL_FALSE, 0, h_size, &H_bin[0], &stage);
+		queue.enqueueReadBuffer(buffers.hist_cumulative, CL_FALSE, 0, h_size, &CH_bin[0], &stage);
+		if (compact) { queue.enqueueReadBuffer(buffers.lut_compact, CL_FALSE, 0, LUT_compact.size(), &LUT_compact[0], &stage); }
+		else { queue.enqueueReadBuffer(buffers.lut, CL_FALSE, 0, h_size, &LUT_table[0], &stage); }
+	}
+
+	//4.3 Copy the result from device to host
+	queue.enqueueReadBuffer(buffers.image_output, CL_TRUE, 0, image_input.size(), &output_buffer.data()[0], &stage);
+	queue.finish();
+
+	if (compact) { std::copy(LUT_compact.begin(), LUT_compact.end(), LUT_table.begin()); }
+
+	if (!options.verbose) { return; }
+
+	/* Information regarding execution times and the size of bins required. */
+
+	std::cout << "Histogram [" << options.hist_kernel << "] : ";
+	if (options.dump_intermediates) { std::cout << H_bin << "\t"; }
+	std::cout << "kernel exec. time in ns: " << prof_event_simple.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event_simple.getProfilingInfo<CL_PROFILING_COMMAND_START>() << "\n";
+
+	std::cout << "Histogram [cumulative] : ";
+	if (options.dump_intermediates) { std::cout << CH_bin << "\t"; }
+	std::cout << "kernel exec. time in ns: " << prof_event_cumulative.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event_cumulative.getProfilingInfo<CL_PROFILING_COMMAND_START>() << "\n";
+
+	std::cout << "Histogram [normalised & LUT] : ";
+	if (options.dump_intermediates) { std::cout << LUT_table << "\t"; }
+	std::cout << "kernel exec. time in ns: " << prof_event_lut.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event_lut.getProfilingInfo<CL_PROFILING_COMMAND_START>() << "\n";
+
+	if (options.otsu_thresholds > 0) {
+		std::vector<int> thresholds(options.otsu_thresholds);
+		queue.enqueueReadBuffer(buffers.otsu_thresholds, CL_TRUE, 0, thresholds.size() * sizeof(int), &thresholds[0]);
+		std::cout << "Otsu thresholds " << thresholds << " : threshold LUT kernel exec. time in ns: " << prof_event_otsu.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event_otsu.getProfilingInfo<CL_PROFILING_COMMAND_START>() << "\n";
+	}
+
+	std::cout << "LUT [redirective] : kernel exec. time in ns: " << prof_event_redirective.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event_redirective.getProfilingInfo<CL_PROFILING_COMMAND_START>() << "\n";
+}
+
+/* Equalises one 16-bit image (max_value up to 65535) into output_buffer with max_value + 1 bins: range-partitioned
+   histogram, single work-group scan, LUT_table and a 16-bit remap, all chained on the device. Histogram matching,
+   CLAHE and denoising have 8-bit kernels only and are rejected rather than silently skipped. */
+void equalise_image_16(cl::CommandQueue& queue, cl::Program& program, const EqualiseOptions& options, EqualiseBuffers& buffers,
+	const CImg<unsigned short>& image_input, int max_value, vector<unsigned short>& output_buffer) {
+	if (!options.match_file.empty() || (options.clahe_tiles_x > 0) || options.denoise) {
+		throw cl::Error(CL_INVALID_VALUE, "equalise_image_16: -match, -clahe, -denoise and -blur need 8-bit input");
+	}
+
+	size_t N = image_input.size();
+	int nr_bins = std::min(std::max(max_value, INT_BIN_SIZE) + 1, 65536);
+
+	buffers.reserve(N * sizeof(unsigned short), nr_bins);
+
+	std::vector<cl::Event> stage(1);
+	queue.enqueueWriteBuffer(buffers.image_input, CL_FALSE, 0, N * sizeof(unsigned short), image_input.data(), NULL, &stage[0]);
+
+	/* Histogram -> one group per (pixel chunk, bin slice sized to the local memory) */
+	cl::Event prof_event_hist = EnqueueHistogramRanged(queue, program, buffers.image_input, sizeof(cl_ushort), N, buffers.hist, nr_bins, &stage);
+	stage[0] = prof_event_hist;
+
+	cl::Event prof_event_cumulative = enqueue_cumulative(queue, program, buffers.hist, buffers.hist_cumulative, nr_bins, true, &stage);
+	stage[0] = prof_event_cumulative;
+
+	cl::Event prof_event_lut = options.auto_levels
+		? enqueue_lut_levels(queue, program, buffers.hist_cumulative, buffers.level_fractions, buffers.level_bins, buffers.lut, nr_bins, &stage)
+		: enqueue_lut(queue, program, buffers.hist_cumulative, buffers.lut, nr_bins, &stage, options.fixed_point_lut);
+	stage[0] = prof_event_lut;
+
+	if (options.otsu_thresholds > 0) { stage[0] = enqueue_otsu(queue, program, buffers, nr_bins, options.otsu_thresholds, &stage); }
+
+	cl::Kernel kernel_remap = cl::Kernel(program, "LUT_redirective_ushort");
+	kernel_remap.setArg(0, buffers.image_input);
+	kernel_remap.setArg(1, buffers.lut);
+	kernel_remap.setArg(2, buffers.image_output);
+	kernel_remap.setArg(3, (int)N);
+	kernel_remap.setArg(4, nr_bins);
+
+	cl::Event prof_event_remap;
+	queue.enqueueNDRangeKernel(kernel_remap, cl::NullRange, cl::NDRange(N), cl::NullRange, &stage, &prof_event_remap);
+	stage[0] = prof_event_remap;
+
+	queue.enqueueReadBuffer(buffers.image_output, CL_TRUE, 0, N * sizeof(unsigned short), &output_buffer.data()[0], &stage);
+
+	if (!options.verbose) { return; }
+
+	std::cout << "Histogram [16-bit, " << nr_bins << " bins] : kernel exec. time in ns: " << prof_event_hist.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event_hist.getProfilingInfo<CL_PROFILING_COMMAND_START>() << "\n";
+	std::cout << "Histogram [cumulative] : kernel exec. time in ns: " << prof_event_cumulative.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event_cumulative.getProfilingInfo<CL_PROFILING_COMMAND_START>() << "\n";
+	std::cout << "Histogram [normalised & LUT] : kernel exec. time in ns: " << prof_event_lut.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event_lut.getProfilingInfo<CL_PROFILING_COMMAND_START>() << "\n";
+	std::cout << "LUT [redirective, 16-bit] : kernel exec. time in ns: " << prof_event_remap.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event_remap.getProfilingInfo<CL_PROFILING_COMMAND_START>() << "\n";
+}
+
+/* Computes the inclusive cumulative histogram of the histogram matching reference into buffers.reference_cumulative,
+   once per run: the reference is either an image (grey histogram, or luma histogram for colour like equalise_image_colour)
+   or a text file of 256 bin counts separated by spaces, commas or new lines, which is scanned on the device as well. */
+void load_match_reference(cl::CommandQueue& queue, cl::Program& program, const EqualiseOptions& options, EqualiseBuffers& buffers) {
+	string extension = std::filesystem::path(options.match_file).extension().string();
+	std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+
+	buffers.reserve(0, INT_BIN_SIZE);
+	buffers.reference_cumulative = cl::Buffer(buffers.context, CL_MEM_READ_WRITE, INT_BIN_SIZE * sizeof(int));
+
+	std::vector<cl::Event> stage(1);
+
+	if ((extension == ".pgm") || (extension == ".ppm")) {
+		CImg<unsigned char> reference(options.match_file.c_str());
+		size_t N = (size_t)reference.width() * reference.height() * reference.depth();
+
+		buffers.reserve(reference.size(), INT_BIN_SIZE);
+
+		std::vector<cl::Event> upload(2);
+		queue.enqueueWriteBuffer(buffers.image_input, CL_FALSE, 0, reference.size(), reference.data(), NULL, &upload[0]);
+		queue.enqueueFillBuffer(buffers.hist, 0, 0, INT_BIN_SIZE * sizeof(int), NULL, &upload[1]);
+
+		if ((reference.spectrum() == 3) && (options.colour_mode == "luma")) { stage[0] = enqueue_histogram_luma(queue, program, buffers.image_input, buffers.hist, N, &upload); }
+		else { stage[0] = enqueue_histogram(queue, program, "local", buffers.image_input, buffers.hist, reference.size(), INT_BIN_SIZE, options.hist_replicas, 1, &upload); }
+	}
+	else {
+		ifstream file(options.match_file);
+		std::vector<int> H;
+		string token;
+		while (file >> token) {
+			std::replace(token.begin(), token.end(), ',', ' ');
+			stringstream values(token);
+			int value;
+			while (values >> value) { H.push_back(value); }
+		}
+
+		if (H.size() != INT_BIN_SIZE) {
+			std::cerr << "Expected " << INT_BIN_SIZE << " bin counts in " << options.match_file << ", found " << H.size() << std::endl;
+			throw cl::Error(CL_INVALID_VALUE, "load_match_reference");
+		}
+
+		queue.enqueueWriteBuffer(buffers.hist, CL_FALSE, 0, INT_BIN_SIZE * sizeof(int), &H[0], NULL, &stage[0]);
+	}
 
-void print_help() {
-	std::cerr << "Application usage:" << std::endl;
+	enqueue_cumulative(queue, program, buffers.hist, buffers.reference_cumulative, INT_BIN_SIZE, true, &stage);
+	queue.finish();
+}
 
-	std::cerr << "  -p : select platform " << std::endl;
-	std::cerr << "  -d : select device" << std::endl;
-	std::cerr << "  -l : list all platforms and devices" << std::endl;
-	std::cerr << "  -f : input image file (default: test.ppm)" << std::endl;
-	std::cerr << "  -h : print this message" << std::endl;
+/* Per-channel histograms and inclusive cumulative histograms of an 8-bit image for QA, computed in one pass over
+   the planar data and one scan launch (a work-group per channel). H and CH receive spectrum() x 256 ints, channel
+   after channel. Uses the hist and hist_cumulative buffers, so it must not overlap an equalisation in flight. */
+void channel_histograms(cl::CommandQueue& queue, cl::Program& program, EqualiseBuffers& buffers, const CImg<unsigned char>& image,
+	std::vector<int>& H, std::vector<int>& CH) {
+	size_t N = (size_t)image.width() * image.height() * image.depth();
+	int C = image.spectrum();
+	size_t h_size = C * INT_BIN_SIZE * sizeof(int);
+
+	buffers.reserve(image.size(), C * INT_BIN_SIZE);
+	H.resize(C * INT_BIN_SIZE);
+	CH.resize(C * INT_BIN_SIZE);
+
+	std::vector<cl::Event> stage(2);
+	queue.enqueueWriteBuffer(buffers.image_input, CL_FALSE, 0, image.size(), image.data(), NULL, &stage[0]);
+	queue.enqueueFillBuffer(buffers.hist, 0, 0, h_size, NULL, &stage[1]);
+
+	cl::Event prof_event_hist = enqueue_histogram_channels(queue, program, buffers.image_input, buffers.hist, N, C, INT_BIN_SIZE, &stage);
+	stage.assign(1, prof_event_hist);
+
+	stage[0] = enqueue_cumulative(queue, program, buffers.hist, buffers.hist_cumulative, INT_BIN_SIZE, true, &stage, C);
+
+	queue.enqueueReadBuffer(buffers.hist, CL_FALSE, 0, h_size, &H[0], &stage);
+	queue.enqueueReadBuffer(buffers.hist_cumulative, CL_TRUE, 0, h_size, &CH[0], &stage);
+}
+
+/* Statistics of the N values of type T in buffers.image_input, e.g. the input of the last equalisation, reduced on
+   the device: only the 4 totals are read back. */
+template <typename T>
+ImageStats image_stats(cl::CommandQueue& queue, EqualiseBuffers& buffers, size_t N) {
+	return buffers.stats.Compute<T>(queue, buffers.image_input, N);
+}
+
+std::ostream& operator<<(std::ostream& out, const ImageStats& stats) {
+	return out << "min " << stats.min << ", max " << stats.max << ", mean " << stats.mean << ", variance " << stats.variance;
+}
+
+/* Writes the per-channel histograms of channel_histograms as CSV, one row per bin: bin, then H and CH of every channel. */
+void save_channel_histograms(const string& file_name, int C, const std::vector<int>& H, const std::vector<int>& CH) {
+	ofstream file(file_name);
+
+	file << "bin";
+	for (int c = 0; c < C; c++) { file << ",hist_" << c << ",cumulative_" << c; }
+	file << "\n";
+
+	for (int bin = 0; bin < INT_BIN_SIZE; bin++) {
+		file << bin;
+		for (int c = 0; c < C; c++) { file << "," << H[c * INT_BIN_SIZE + bin] << "," << CH[c * INT_BIN_SIZE + bin]; }
+		file << "\n";
+	}
+}
+
+/* Writes image_stats as CSV, a header and one row. */
+void save_image_stats(const string& file_name, const ImageStats& stats) {
+	ofstream file(file_name);
+
+	file << "min,max,mean,variance\n";
+	file << stats.min << "," << stats.max << "," << stats.mean << "," << stats.variance << "\n";
+}
+
+/* Shows the input and output images until one of the windows is closed or ESC is pressed. */
+template <typename T>
+void display_images(const CImg<T>& image_input, const CImg<T>& output_image) {
+	CImgDisplay disp_input(image_input,"input");
+	CImgDisplay disp_output(output_image,"output");
+
+	while (!disp_input.is_closed() && !disp_output.is_closed()
+		&& !disp_input.is_keyESC() && !disp_output.is_keyESC()) {
+		disp_input.wait(1);
+		disp_output.wait(1);
+	}
+}
+
+/* Collects the images of a batch: every .pgm/.ppm file of a directory, or one path per line of a list file. */
+std::vector<string> batch_files(const string& batch_path) {
+	std::vector<string> files;
+
+	if (std::filesystem::is_directory(batch_path)) {
+		for (const auto& entry : std::filesystem::directory_iterator(batch_path)) {
+			string extension = entry.path().extension().string();
+			std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+			if (entry.is_regular_file() && ((extension == ".pgm") || (extension == ".ppm"))) { files.push_back(entry.path().string()); }
+		}
+		std::sort(files.begin(), files.end());
+	}
+	else {
+		ifstream list(batch_path);
+		string line;
+		while (std::getline(list, line)) {
+			line.erase(line.find_last_not_of(" \t\r") + 1);
+			if (!line.empty()) { files.push_back(line); }
+		}
+	}
+
+	return files;
+}
+
+/* Equalises every image of the batch with the same queue, program and buffers and writes the results
+   to output_dir (or next to the input with an _eq suffix). Reports the throughput in images per second. */
+void equalise_batch(cl::CommandQueue& queue, cl::Program& program, EqualiseOptions options, EqualiseBuffers& buffers,
+	const string& batch_path, const string& output_dir) {
+	std::vector<string> files = batch_files(batch_path);
+	vector<unsigned char> output_buffer;
+	vector<unsigned short> output_buffer_16;
+	std::vector<int> H, CH;
+	size_t processed = 0;
+
+	options.verbose = false;
+
+	if (!output_dir.empty()) { std::filesystem::create_directories(output_dir); }
+
+	auto start_time = std::chrono::high_resolution_clock::now();
+
+	for (const string& file : files) {
+		try {
+			std::filesystem::path input_path(file);
+			std::filesystem::path output_path = output_dir.empty()
+				? input_path.parent_path() / (input_path.stem().string() + "_eq" + input_path.extension().string())
+				: std::filesystem::path(output_dir) / input_path.filename();
+
+			int max_value = pnm_max_value(file);
+
+			if (max_value > 255) {
+				CImg<unsigned short> image_input(file.c_str());
+				output_buffer_16.resize(image_input.size());
+
+				equalise_image_16(queue, program, options, buffers, image_input, max_value, output_buffer_16);
+
+				CImg<unsigned short>(output_buffer_16.data(), image_input.width(), image_input.height(), image_input.depth(), image_input.spectrum()).save(output_path.string().c_str());
+
+				if (options.channel_stats) {
+					save_image_stats((output_path.parent_path() / (input_path.stem().string() + "_stats.csv")).string(), image_stats<unsigned short>(queue, buffers, image_input.size()));
+				}
+			}
+			else {
+				CImg<unsigned char> image_input(file.c_str());
+				output_buffer.resize(image_input.size());
+
+				equalise_image(queue, program, options, buffers, image_input, output_buffer);
+
+				CImg<unsigned char>(output_buffer.data(), image_input.width(), image_input.height(), image_input.depth(), image_input.spectrum()).save(output_path.string().c_str());
+
+				if (options.channel_stats) {
+					save_image_stats((output_path.parent_path() / (input_path.stem().string() + "_stats.csv")).string(), image_stats<unsigned char>(queue, buffers, image_input.size()));
+					channel_histograms(queue, program, buffers, image_input, H, CH);
+					save_channel_histograms((output_path.parent_path() / (input_path.stem().string() + "_hist.csv")).string(), image_input.spectrum(), H, CH);
+				}
+			}
+			processed++;
+		}
+		catch (CImgException& err) {
+			std::cerr << "ERROR: " << file << ": " << err.what() << std::endl;
+		}
+		catch (const cl::Error& err) {
+			//one unsupported or failing image does not stop the rest of the batch
+			std::cerr << "ERROR: " << file << ": " << err.what() << ", " << getErrorString(err.err()) << std::endl;
+		}
+	}
+
+	double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start_time).count();
+
+	std::cout << "Batch: " << processed << " of " << files.size() << " images in " << seconds << " s, " << (seconds > 0 ? processed / seconds : 0.0) << " images per second" << std::endl;
+}
+
+/* Compares the histogram kernels on a flat (single grey level) image and on a uniform-noise image. */
+void benchmark_histograms(cl::Context& context, cl::CommandQueue& queue, cl::Program& program, int replicas, int vec_width) {
+	const size_t N = 4096 * 4096; const int nr_bins = INT_BIN_SIZE; const int repeats = 10;
+	size_t h_size = nr_bins * sizeof(int);
+
+	std::vector<unsigned char> flat_image(N, 128);
+	std::vector<unsigned char> noise_image(N);
+	std::mt19937 generator(42);
+	std::uniform_int_distribution<int> distribution(0, 255);
+	for (size_t i = 0; i < N; i++) { noise_image[i] = (unsigned char)distribution(generator); }
+
+	cl::Buffer dev_image(context, CL_MEM_READ_ONLY, N);
+	cl::Buffer dev_hist(context, CL_MEM_READ_WRITE, h_size);
+	cl::Buffer dev_output(context, CL_MEM_WRITE_ONLY, N);
+
+	std::vector<int> identity_lut(nr_bins);
+	for (int i = 0; i < nr_bins; i++) { identity_lut[i] = i; }
+	cl::Buffer dev_lut(context, CL_MEM_READ_ONLY, h_size);
+	queue.enqueueWriteBuffer(dev_lut, CL_TRUE, 0, h_size, &identity_lut[0]);
+
+	std::vector<unsigned char> identity_lut_compact(identity_lut.begin(), identity_lut.end());
+	cl::Buffer dev_lut_compact(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, (size_t)nr_bins, identity_lut_compact.data());
+
+	std::vector<string> hist_kernels = { "simple", "local", "replicated" };
+	std::vector<std::pair<string, std::vector<unsigned char>*>> images = { { "flat", &flat_image }, { "uniform noise", &noise_image } };
+
+	for (auto& image : images) {
+		queue.enqueueWriteBuffer(dev_image, CL_TRUE, 0, N, image.second->data());
+
+		std::cout << "Histogram benchmark [" << image.first << ", " << N << " pixels, replicas " << replicas << "]" << std::endl;
+
+		std::vector<int> reference;
+		for (const string& hist_kernel : hist_kernels) {
+			for (int width : { 1, vec_width }) {
+				cl_ulong total_ns = 0;
+				std::vector<int> H(nr_bins);
+
+				for (int r = 0; r < repeats; r++) {
+					queue.enqueueFillBuffer(dev_hist, 0, 0, h_size);
+					cl::Event prof_event = enqueue_histogram(queue, program, hist_kernel, dev_image, dev_hist, N, nr_bins, replicas, width);
+					prof_event.wait();
+					total_ns += prof_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+				}
+				queue.enqueueReadBuffer(dev_hist, CL_TRUE, 0, h_size, &H[0]);
+
+				if (reference.empty()) { reference = H; }
+
+				std::cout << "  " << hist_kernel << " x" << width << ": " << total_ns / repeats << " ns" << ((H == reference) ? "" : " (MISMATCH)") << std::endl;
+
+				if (vec_width == 1) { break; }
+			}
+		}
+
+		for (int width : { 1, vec_width }) {
+			cl_ulong total_ns = 0;
+
+			for (int r = 0; r < repeats; r++) {
+				cl::Event prof_event = enqueue_remap(queue, program, dev_image, dev_lut, dev_output, N, width);
+				prof_event.wait();
+				total_ns += prof_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+			}
+
+			std::cout << "  LUT remap x" << width << ": " << total_ns / repeats << " ns, " << (2.0 * N * repeats) / total_ns << " GB/s" << std::endl;
+
+			if (vec_width == 1) { break; }
+		}
+
+		/* Compact uchar LUT in local memory, always at the program's VEC_WIDTH */
+		cl_ulong compact_ns = 0;
+		for (int r = 0; r < repeats; r++) {
+			cl::Event prof_event = enqueue_remap_compact(queue, program, dev_image, dev_lut_compact, dev_output, N, vec_width);
+			prof_event.wait();
+			compact_ns += prof_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+		}
+
+		std::vector<unsigned char> remapped(N);
+		queue.enqueueReadBuffer(dev_output, CL_TRUE, 0, N, &remapped[0]);
+
+		std::cout << "  LUT remap compact x" << vec_width << ": " << compact_ns / repeats << " ns, " << (2.0 * N * repeats) / compact_ns << " GB/s"
+			<< ((remapped == *image.second) ? "" : " (MISMATCH)") << std::endl;
+	}
+}
+
+/* Measures the throughput of both EnqueueScan modes on 1M to 256M ints and checks the results against the host.
+   GB/s counts the minimum traffic (one read and one write per element); the hierarchical scan moves about twice that. */
+void benchmark_scan(cl::Context& context, cl::CommandQueue& queue, cl::Program& program) {
+	cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+	cl_ulong max_alloc = device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+	const int repeats = 5;
+
+	std::cout << "Scan benchmark [inclusive]" << std::endl;
+
+	for (size_t N = 1 << 20; N <= (size_t)1 << 28; N *= 4) {
+		if (N * sizeof(int) > max_alloc) {
+			std::cout << "  " << N << " ints: skipped, exceeds CL_DEVICE_MAX_MEM_ALLOC_SIZE" << std::endl;
+			continue;
+		}
+
+		std::vector<int> A(N);
+		std::mt19937 generator(42);
+		std::uniform_int_distribution<int> distribution(0, 3);
+		for (size_t i = 0; i < N; i++) { A[i] = distribution(generator); }
+
+		cl::Buffer dev_A(context, CL_MEM_READ_ONLY, N * sizeof(int));
+		cl::Buffer dev_B(context, CL_MEM_READ_WRITE, N * sizeof(int));
+		queue.enqueueWriteBuffer(dev_A, CL_TRUE, 0, N * sizeof(int), &A[0]);
+
+		std::vector<int> reference(N);
+		std::partial_sum(A.begin(), A.end(), reference.begin());
+
+		std::vector<std::pair<string, ScanMode>> modes = { { "hierarchical", SCAN_HIERARCHICAL }, { "lookback", SCAN_LOOKBACK } };
+		for (auto& mode : modes) {
+			//warm-up run, also used for validation
+			EnqueueScan(queue, program, dev_A, dev_B, N, true, mode.second);
+			std::vector<int> B(N);
+			queue.enqueueReadBuffer(dev_B, CL_TRUE, 0, N * sizeof(int), &B[0]);
+
+			auto start = std::chrono::high_resolution_clock::now();
+			for (int r = 0; r < repeats; r++) { EnqueueScan(queue, program, dev_A, dev_B, N, true, mode.second); }
+			queue.finish();
+			double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count() / repeats;
+
+			//hierarchical: read + write in scan_blocks, read + write again in scan_add_offsets
+			double traffic_mb = ((mode.second == SCAN_HIERARCHICAL) ? 4.0 : 2.0) * N * sizeof(int) / 1e6;
+
+			std::cout << "  " << N << " ints, " << mode.first << ": " << seconds * 1e3 << " ms, " << 2.0 * N * sizeof(int) / seconds / 1e9 << " GB/s, ~"
+				<< traffic_mb << " MB moved" << ((B == reference) ? "" : " (MISMATCH)") << std::endl;
+		}
+	}
+}
+
+/* Times EnqueueHistogramRanged on 16M random 32-bit IDs for 64K to 1M bins and checks it against the host. */
+void benchmark_ranged_histogram(cl::Context& context, cl::CommandQueue& queue, cl::Program& program) {
+	const size_t N = 1 << 24;
+
+	//half of the IDs below 2^20, half over the whole 32-bit range, so every bin count also sees values to ignore
+	std::vector<unsigned int> ids(N);
+	std::mt19937 generator(42);
+	for (size_t i = 0; i < N; i++) { ids[i] = (i % 2) ? generator() : generator() % (1 << 20); }
+
+	cl::Buffer dev_ids(context, CL_MEM_READ_ONLY, N * sizeof(cl_uint));
+	queue.enqueueWriteBuffer(dev_ids, CL_TRUE, 0, N * sizeof(cl_uint), &ids[0]);
+
+	std::cout << "Range-partitioned histogram benchmark [" << N << " uint IDs]" << std::endl;
+
+	for (size_t nr_bins = 1 << 16; nr_bins <= (1 << 20); nr_bins *= 4) {
+		//IDs at or above nr_bins are not counted, on the device as on the host
+		std::vector<int> reference(nr_bins), H(nr_bins);
+		for (size_t i = 0; i < N; i++) {
+			if (ids[i] < nr_bins) { reference[ids[i]]++; }
+		}
+
+		cl::Buffer dev_hist(context, CL_MEM_READ_WRITE, nr_bins * sizeof(int));
+		cl::Event prof_event = EnqueueHistogramRanged(queue, program, dev_ids, sizeof(cl_uint), N, dev_hist, nr_bins);
+		queue.enqueueReadBuffer(dev_hist, CL_TRUE, 0, nr_bins * sizeof(int), &H[0]);
+
+		std::cout << "  " << nr_bins << " bins: " << prof_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event.getProfilingInfo<CL_PROFILING_COMMAND_START>()
+			<< " ns" << ((H == reference) ? "" : " (MISMATCH)") << std::endl;
+	}
+}
+
+/* Times StatsEngine on the values against a single-threaded host pass over the same data, and reports the largest
+   relative difference of the four statistics (0 for integer data, rounding only for float data). */
+template <typename T>
+void benchmark_image_stats(cl::Context& context, cl::CommandQueue& queue, StatsEngine& engine, const std::vector<T>& values) {
+	typedef typename std::conditional<std::is_floating_point<T>::value, double, unsigned long long>::type Accumulator;
+	size_t N = values.size();
+
+	cl::Buffer dev_values(context, CL_MEM_READ_ONLY, N * sizeof(T));
+	queue.enqueueWriteBuffer(dev_values, CL_TRUE, 0, N * sizeof(T), &values[0]);
+	engine.Program<T>(); //built before the timing starts
+
+	auto start_time = std::chrono::high_resolution_clock::now();
+	Accumulator lo = values[0], hi = values[0], sum = 0, squares = 0;
+	for (T value : values) {
+		lo = std::min<Accumulator>(lo, value);
+		hi = std::max<Accumulator>(hi, value);
+		sum += value;
+		squares += (Accumulator)value * value;
+	}
+	ImageStats reference;
+	reference.min = (double)lo;
+	reference.max = (double)hi;
+	reference.mean = (double)sum / N;
+	reference.variance = std::max((double)squares / N - reference.mean * reference.mean, 0.0);
+	double host_ns = std::chrono::duration<double, std::nano>(std::chrono::high_resolution_clock::now() - start_time).count();
+
+	//device time from the first enqueue to the statistics on the host, both stages and the read included
+	start_time = std::chrono::high_resolution_clock::now();
+	ImageStats stats = engine.Compute<T>(queue, dev_values, N);
+	double device_ns = std::chrono::duration<double, std::nano>(std::chrono::high_resolution_clock::now() - start_time).count();
+
+	double difference = 0.0;
+	for (auto member : { &ImageStats::min, &ImageStats::max, &ImageStats::mean, &ImageStats::variance }) {
+		difference = std::max(difference, std::fabs(stats.*member - reference.*member) / std::max(std::fabs(reference.*member), 1e-30));
+	}
+
+	std::cout << "  " << ClTypeName<T>() << ": device " << device_ns << " ns, host " << host_ns << " ns, largest relative difference " << difference << std::endl;
+}
+
+/* Image statistics of 16-bit noise and of normally distributed floats. */
+void benchmark_stats(cl::Context& context, cl::CommandQueue& queue, StatsEngine& engine) {
+	const size_t N = (1 << 24) + 5; //not a multiple of the vector width, so the tail is covered too
+
+	std::cout << "Image statistics benchmark [" << N << " values]" << std::endl;
+
+	std::mt19937 generator(42);
+	std::vector<unsigned short> pixels(N);
+	for (size_t i = 0; i < N; i++) { pixels[i] = (unsigned short)generator(); }
+	benchmark_image_stats(context, queue, engine, pixels);
+
+	std::normal_distribution<float> distribution(0.5f, 2.0f);
+	std::vector<float> samples(N);
+	for (size_t i = 0; i < N; i++) { samples[i] = distribution(generator); }
+	benchmark_image_stats(context, queue, engine, samples);
+}
+
+/* Frames per second of CLAHE (8x8 tiles, clip 2) on a 4K greyscale gradient with noise, upload and read back included. */
+void benchmark_clahe(cl::Context& context, cl::CommandQueue& queue, cl::Program& program) {
+	const int width = 3840, height = 2160; const int repeats = 20;
+
+	CImg<unsigned char> image(width, height);
+	std::mt19937 generator(42);
+	std::uniform_int_distribution<int> distribution(-16, 16);
+	cimg_forXY(image, x, y) { image(x, y) = (unsigned char)std::min(255, std::max(0, x * 192 / width + y * 32 / height + distribution(generator))); }
+
+	EqualiseOptions options;
+	options.clahe_tiles_x = options.clahe_tiles_y = 8;
+	options.verbose = false;
+
+	EqualiseBuffers buffers(context);
+	vector<unsigned char> output_buffer(image.size());
+
+	equalise_image_clahe(queue, program, options, buffers, image, output_buffer); //warm-up, allocates the buffers
+
+	auto start_time = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < repeats; i++) { equalise_image_clahe(queue, program, options, buffers, image, output_buffer); }
+	double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start_time).count();
+
+	std::cout << "CLAHE benchmark [" << width << "x" << height << ", 8x8 tiles]: " << seconds * 1e3 / repeats << " ms per frame, " << repeats / seconds << " fps" << std::endl;
+}
+
+/* Gaussian pre-blur of a 1024x1024 noise image with 15x15 and 31x31 masks: the tiled 2D kernel against the separable
+   row/column passes on the device, and CImg's get_convolve on the host as the baseline (and reference for the results). */
+void benchmark_convolution(cl::Context& context, cl::CommandQueue& queue, cl::Program& program) {
+	const int width = 1024, height = 1024; const int repeats = 10;
+	const size_t N = (size_t)width * height;
+
+	CImg<unsigned char> image(width, height);
+	std::mt19937 generator(42);
+	std::uniform_int_distribution<int> distribution(0, 255);
+	cimg_forXY(image, x, y) { image(x, y) = (unsigned char)distribution(generator); }
+
+	cl::Buffer dev_image(context, CL_MEM_READ_ONLY, N);
+	cl::Buffer dev_rows(context, CL_MEM_READ_WRITE, N * sizeof(float));
+	cl::Buffer dev_output(context, CL_MEM_WRITE_ONLY, N);
+	queue.enqueueWriteBuffer(dev_image, CL_TRUE, 0, N, image.data());
+
+	std::vector<unsigned char> output(N);
+
+	for (float sigma : { 2.5f, 5.0f }) {
+		std::vector<float> weights = gaussian_weights(sigma);
+		int radius = (int)weights.size() / 2;
+
+		std::vector<float> mask(weights.size() * weights.size());
+		for (size_t i = 0; i < weights.size(); i++) {
+			for (size_t j = 0; j < weights.size(); j++) { mask[i * weights.size() + j] = weights[i] * weights[j]; }
+		}
+
+		cl::Buffer dev_mask(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, mask.size() * sizeof(float), mask.data());
+		cl::Buffer dev_weights(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, weights.size() * sizeof(float), weights.data());
+
+		auto start_time = std::chrono::high_resolution_clock::now();
+		CImg<float> reference = image.get_convolve(CImg<float>(mask.data(), (int)weights.size(), (int)weights.size()));
+		double cimg_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start_time).count();
+
+		std::cout << "Convolution benchmark [" << width << "x" << height << ", " << weights.size() << "x" << weights.size() << " Gaussian]" << std::endl;
+		std::cout << "  CImg get_convolve (host): " << cimg_ms << " ms" << std::endl;
+
+		for (bool separable : { false, true }) {
+			//wall time of the whole launch sequence, both passes for the separable mode
+			auto launch_time = std::chrono::high_resolution_clock::now();
+			for (int i = 0; i < repeats; i++) {
+				if (separable) { enqueue_convolution_separable(queue, program, dev_image, dev_rows, dev_output, dev_weights, dev_weights, radius, width, height, 1); }
+				else { enqueue_convolution(queue, program, dev_image, dev_output, dev_mask, radius, width, height, 1); }
+			}
+			queue.finish();
+			double device_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - launch_time).count() / repeats;
+
+			queue.enqueueReadBuffer(dev_output, CL_TRUE, 0, N, &output[0]);
+
+			int max_difference = 0;
+			cimg_forXY(reference, x, y) {
+				int expected = (int)std::lround(std::min(255.0f, std::max(0.0f, reference(x, y))));
+				max_difference = std::max(max_difference, std::abs(expected - (int)output[(size_t)y * width + x]));
+			}
+
+			std::cout << "  " << (separable ? "separable rows + columns" : "tiled 2D") << ": " << device_ms << " ms, max difference to CImg " << max_difference << std::endl;
+		}
+	}
+}
+
+/* Buffer against image back end on the same device, 2048x2048 noise: 3x3 box convolution and LUT remap (kernel times)
+   and a whole CLAHE frame (wall time), with the number of pixels where the two back ends disagree. */
+void benchmark_images(cl::Context& context, cl::CommandQueue& queue, cl::Program& program, int vec_width) {
+	if (!context.getInfo<CL_CONTEXT_DEVICES>()[0].getInfo<CL_DEVICE_IMAGE_SUPPORT>()) {
+		std::cout << "Image benchmark skipped, the device has no image support" << std::endl;
+		return;
+	}
+
+	const int width = 2048, height = 2048; const int repeats = 10;
+	const size_t N = (size_t)width * height;
+
+	CImg<unsigned char> image(width, height);
+	std::mt19937 generator(42);
+	std::uniform_int_distribution<int> distribution(0, 255);
+	cimg_forXY(image, x, y) { image(x, y) = (unsigned char)distribution(generator); }
+
+	std::vector<float> box_mask(9, 1.f / 9);
+	std::vector<int> identity_lut(INT_BIN_SIZE);
+	std::iota(identity_lut.begin(), identity_lut.end(), 0);
+
+	cl::Buffer dev_image(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, N, image.data());
+	cl::Image2D dev_image_2d(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, cl::ImageFormat(CL_R, CL_UNORM_INT8), width, height, 0, image.data());
+	cl::Buffer dev_mask(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, box_mask.size() * sizeof(float), box_mask.data());
+	cl::Buffer dev_lut(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, INT_BIN_SIZE * sizeof(int), identity_lut.data());
+	cl::Buffer dev_output(context, CL_MEM_WRITE_ONLY, N);
+
+	std::cout << "Image back end benchmark [" << width << "x" << height << "]" << std::endl;
+
+	std::vector<unsigned char> output_buffer(N), output_image(N);
+
+	for (const string stage : { "convolution 3x3", "LUT remap" }) {
+		for (bool images : { false, true }) {
+			cl_ulong total_ns = 0;
+
+			for (int i = 0; i < repeats; i++) {
+				cl::Event prof_event;
+				if (stage == "LUT remap") {
+					prof_event = images ? enqueue_remap_image(queue, program, dev_image_2d, dev_lut, dev_output, width, height)
+						: enqueue_remap(queue, program, dev_image, dev_lut, dev_output, N, vec_width);
+				}
+				else {
+					prof_event = images ? enqueue_convolution_image(queue, program, dev_image_2d, dev_output, dev_mask, 1, width, height, 1)
+						: enqueue_convolution(queue, program, dev_image, dev_output, dev_mask, 1, width, height, 1);
+				}
+				prof_event.wait();
+				total_ns += prof_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+			}
+
+			queue.enqueueReadBuffer(dev_output, CL_TRUE, 0, N, images ? &output_image[0] : &output_buffer[0]);
+			std::cout << "  " << stage << ", " << (images ? "image" : "buffer") << ": " << total_ns / repeats << " ns" << std::endl;
+		}
+
+		std::cout << "  " << stage << ", differing pixels: " << N - std::inner_product(output_buffer.begin(), output_buffer.end(), output_image.begin(), (size_t)0, std::plus<size_t>(), std::equal_to<unsigned char>()) << std::endl;
+	}
+
+	EqualiseOptions options;
+	options.clahe_tiles_x = options.clahe_tiles_y = 8;
+	options.verbose = false;
+	EqualiseBuffers buffers(context);
+
+	for (bool images : { false, true }) {
+		options.use_images = images;
+		equalise_image_clahe(queue, program, options, buffers, image, images ? output_image : output_buffer); //warm-up
+
+		auto start_time = std::chrono::high_resolution_clock::now();
+		for (int i = 0; i < repeats; i++) { equalise_image_clahe(queue, program, options, buffers, image, images ? output_image : output_buffer); }
+		double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start_time).count();
+
+		std::cout << "  CLAHE 8x8 frame, " << (images ? "image" : "buffer") << ": " << seconds * 1e3 / repeats << " ms" << std::endl;
+	}
+
+	std::cout << "  CLAHE, differing pixels: " << N - std::inner_product(output_buffer.begin(), output_buffer.end(), output_image.begin(), (size_t)0, std::plus<size_t>(), std::equal_to<unsigned char>()) << std::endl;
+}
+
+/* Host reference of the equalisation LUT, the definition every LUT kernel must match bit for bit:
+   floor(CH[id] * (nr_bins - 1) / CH[nr_bins - 1]) in exact integer arithmetic, a bin holding every count keeps its value. */
+int lut_reference(const std::vector<int>& CH, int id, int nr_bins) {
+	int total = CH[nr_bins - 1];
+	if ((total == 0) || ((CH[id] == total) && ((id == 0) || (CH[id - 1] == 0)))) { return id; }
+	return (int)((long long)CH[id] * (nr_bins - 1) / total);
+}
+
+/* Checks the fixed-point LUT kernels (and the double ones, if the device has fp64) against lut_reference on random,
+   sparse, flat and empty cumulative histograms of 256 and 65536 bins with totals up to 2^31 - 1. */
+void validate_lut(cl::Context& context, cl::CommandQueue& queue, cl::Program& program) {
+	bool has_fp64 = device_has_fp64(context.getInfo<CL_CONTEXT_DEVICES>()[0]);
+	std::mt19937 generator(42);
+
+	std::cout << "LUT validation against the host reference" << (has_fp64 ? "" : " (no fp64, double kernels skipped)") << std::endl;
+
+	for (int nr_bins : { INT_BIN_SIZE, 65536 }) {
+		std::vector<std::pair<string, std::vector<int>>> cases;
+
+		std::vector<int> H(nr_bins);
+		for (int& count : H) { count = (int)(generator() % 32768); }
+		cases.push_back({ "random", H });
+
+		std::fill(H.begin(), H.end(), 0);
+		for (int i = 0; i < 5; i++) { H[generator() % nr_bins] += (int)(generator() % (1 << 28)); }
+		cases.push_back({ "sparse, large total", H });
+
+		std::fill(H.begin(), H.end(), 0);
+		H[nr_bins / 3] = 12345;
+		cases.push_back({ "flat image", H });
+
+		std::fill(H.begin(), H.end(), 0);
+		cases.push_back({ "empty", H });
+
+		cl::Buffer dev_cumulative(context, CL_MEM_READ_ONLY, nr_bins * sizeof(int));
+		cl::Buffer dev_lut(context, CL_MEM_READ_WRITE, nr_bins * sizeof(int));
+
+		for (auto& test : cases) {
+			std::vector<int> CH(nr_bins), reference(nr_bins), LUT(nr_bins);
+			std::partial_sum(test.second.begin(), test.second.end(), CH.begin());
+			for (int i = 0; i < nr_bins; i++) { reference[i] = lut_reference(CH, i, nr_bins); }
+
+			queue.enqueueWriteBuffer(dev_cumulative, CL_TRUE, 0, nr_bins * sizeof(int), &CH[0]);
+
+			std::cout << "  " << nr_bins << " bins, " << test.first << ":";
+			for (bool fixed_point : { true, false }) {
+				if (!fixed_point && !has_fp64) { continue; }
+
+				enqueue_lut(queue, program, dev_cumulative, dev_lut, nr_bins, NULL, fixed_point);
+				queue.enqueueReadBuffer(dev_lut, CL_TRUE, 0, nr_bins * sizeof(int), &LUT[0]);
+				std::cout << " " << (fixed_point ? "fixed" : "double") << ((LUT == reference) ? " ok" : " MISMATCH");
+
+				if (nr_bins == INT_BIN_SIZE) {
+					std::vector<unsigned char> compact(nr_bins);
+					enqueue_lut_compact(queue, program, dev_cumulative, dev_lut, nr_bins, NULL, fixed_point);
+					queue.enqueueReadBuffer(dev_lut, CL_TRUE, 0, nr_bins, &compact[0]);
+					std::cout << ", uchar" << (std::equal(compact.begin(), compact.end(), reference.begin()) ? " ok" : " MISMATCH");
+				}
+			}
+			std::cout << std::endl;
+		}
+	}
+}
+
+/* Host reference and timing of HistogramEngine for one element type, values drawn from [min_value, max_value]. */
+template <typename T>
+void benchmark_generic_histogram(cl::Context& context, cl::CommandQueue& queue, HistogramEngine& engine, size_t nr_bins, T min_value, T max_value) {
+	const size_t N = 1 << 22;
+
+	std::vector<T> values(N);
+	std::mt19937 generator(42);
+	for (size_t i = 0; i < N; i++) {
+		if (std::is_floating_point<T>::value) { values[i] = (T)std::uniform_real_distribution<double>(min_value, max_value)(generator); }
+		else { values[i] = (T)std::uniform_int_distribution<long long>(min_value, max_value)(generator); }
+	}
+
+	//the host bins with the same formula as bin_index in histogram_generic.cl
+	std::vector<int> reference(nr_bins), H(nr_bins);
+	for (T value : values) {
+		if ((value < min_value) || (value >= max_value)) { continue; }
+		if (std::is_floating_point<T>::value) { reference[std::min<size_t>((size_t)((float)(value - min_value) * ((float)nr_bins / (float)(max_value - min_value))), nr_bins - 1)]++; }
+		else { reference[(size_t)(((long long)value - (long long)min_value) * (long long)nr_bins / ((long long)max_value - (long long)min_value))]++; }
+	}
+
+	cl::Buffer dev_values(context, CL_MEM_READ_ONLY, N * sizeof(T));
+	cl::Buffer dev_hist(context, CL_MEM_READ_WRITE, nr_bins * sizeof(int));
+	queue.enqueueWriteBuffer(dev_values, CL_TRUE, 0, N * sizeof(T), &values[0]);
+
+	cl::Event prof_event = engine.Enqueue<T>(queue, dev_values, N, nr_bins, min_value, max_value, dev_hist);
+	queue.enqueueReadBuffer(dev_hist, CL_TRUE, 0, nr_bins * sizeof(int), &H[0]);
+
+	std::cout << "  " << ClTypeName<T>() << ", " << nr_bins << " bins: " << prof_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event.getProfilingInfo<CL_PROFILING_COMMAND_START>()
+		<< " ns" << ((H == reference) ? "" : " (MISMATCH)") << std::endl;
+}
+
+/* Runs the generic histogram over every supported element type, with bin counts on both sides of the local memory limit. */
+void benchmark_generic_histograms(cl::Context& context, cl::CommandQueue& queue, HistogramEngine& engine) {
+	std::cout << "Generic histogram benchmark [" << (1 << 22) << " values]" << std::endl;
+
+	benchmark_generic_histogram<unsigned char>(context, queue, engine, 64, 16, 240);
+	benchmark_generic_histogram<unsigned short>(context, queue, engine, 1000, 0, 65535);
+	benchmark_generic_histogram<int>(context, queue, engine, 4096, -100000, 100000);
+	benchmark_generic_histogram<int>(context, queue, engine, 1 << 16, -100000, 100000);
+	benchmark_generic_histogram<float>(context, queue, engine, 100, -1.0f, 1.0f);
 }
 
 int main(int argc, char **argv) {
@@ -32,40 +1860,121 @@ int main(int argc, char **argv) {
 	/* Assignment Images -> monochrome */
 	string image_filename = "test.pgm"; //test_large.pgm
 
+	/* Histogram kernel -> simple (global atomics), local (work-group privatisation) or replicated, and the other pipeline settings */
+	EqualiseOptions options;
+	bool benchmark = false;
+	bool fuse_given = false;
+
+	/* Batch mode -> directory or list file of images, and where to write the results */
+	string batch_path;
+	string output_dir;
+
+	/* Compiled kernels are cached on disk, an empty directory disables the cache */
+	string program_cache_dir = "kernel_cache";
+
 	for (int i = 1; i < argc; i++) {
 		if ((strcmp(argv[i], "-p") == 0) && (i < (argc - 1))) { platform_id = atoi(argv[++i]); }
 		else if ((strcmp(argv[i], "-d") == 0) && (i < (argc - 1))) { device_id = atoi(argv[++i]); }
 		else if (strcmp(argv[i], "-l") == 0) { std::cout << ListPlatformsDevices() << std::endl; }
 		else if ((strcmp(argv[i], "-f") == 0) && (i < (argc - 1))) { image_filename = argv[++i]; }
+		else if ((strcmp(argv[i], "-k") == 0) && (i < (argc - 1))) { options.hist_kernel = argv[++i]; }
+		else if ((strcmp(argv[i], "-r") == 0) && (i < (argc - 1))) { options.hist_replicas = std::max(1, atoi(argv[++i])); }
+		else if ((strcmp(argv[i], "-s") == 0) && (i < (argc - 1))) { options.scan_mode = argv[++i]; }
+		else if ((strcmp(argv[i], "-c") == 0) && (i < (argc - 1))) { options.colour_mode = argv[++i]; }
+		else if (strcmp(argv[i], "-denoise") == 0) { options.denoise = true; }
+		else if ((strcmp(argv[i], "-blur") == 0) && (i < (argc - 1))) { options.blur_sigma = (float)atof(argv[++i]); options.denoise = (options.blur_sigma > 0.0f); }
+		else if ((strcmp(argv[i], "-match") == 0) && (i < (argc - 1))) { options.match_file = argv[++i]; }
+		else if ((strcmp(argv[i], "-clahe") == 0) && (i < (argc - 1))) {
+			if (sscanf(argv[++i], "%dx%d", &options.clahe_tiles_x, &options.clahe_tiles_y) != 2) { options.clahe_tiles_x = options.clahe_tiles_y = -1; }
+		}
+		else if ((strcmp(argv[i], "-clip") == 0) && (i < (argc - 1))) { options.clip_limit = (float)atof(argv[++i]); }
+		else if ((strcmp(argv[i], "-fuse") == 0) && (i < (argc - 1))) { options.fused_max_pixels = strtoul(argv[++i], NULL, 10); fuse_given = true; }
+		else if ((strcmp(argv[i], "-w") == 0) && (i < (argc - 1))) { options.vec_width = atoi(argv[++i]); options.vec_width_given = true; }
+		else if (strcmp(argv[i], "--dump-intermediates") == 0) { options.dump_intermediates = true; }
+		else if ((strcmp(argv[i], "-levels") == 0) && (i < (argc - 1))) {
+			options.auto_levels = (sscanf(argv[++i], "%f,%f", &options.levels_low, &options.levels_high) == 2);
+			if (!options.auto_levels || (options.levels_low < 0) || (options.levels_high > 100) || (options.levels_low >= options.levels_high)) {
+				std::cerr << "Invalid percentiles for -levels, expected low,high with 0 <= low < high <= 100" << std::endl;
+				return 1;
+			}
+		}
+		else if ((strcmp(argv[i], "-otsu") == 0) && (i < (argc - 1))) {
+			options.otsu_thresholds = atoi(argv[++i]);
+			if ((options.otsu_thresholds < 1) || (options.otsu_thresholds > 4)) {
+				std::cerr << "Invalid number of thresholds for -otsu, expected 1 to 4" << std::endl;
+				return 1;
+			}
+		}
+		else if ((strcmp(argv[i], "-lut") == 0) && (i < (argc - 1))) { options.lut_mode = argv[++i]; }
+		else if (strcmp(argv[i], "-images") == 0) { options.use_images = true; }
+		else if (strcmp(argv[i], "-qa") == 0) { options.channel_stats = true; }
+		else if ((strcmp(argv[i], "-batch") == 0) && (i < (argc - 1))) { batch_path = argv[++i]; }
+		else if ((strcmp(argv[i], "-o") == 0) && (i < (argc - 1))) { output_dir = argv[++i]; }
+		else if ((strcmp(argv[i], "-cache") == 0) && (i < (argc - 1))) { program_cache_dir = argv[++i]; }
+		else if (strcmp(argv[i], "-nocache") == 0) { program_cache_dir.clear(); }
+		else if (strcmp(argv[i], "-bench") == 0) { benchmark = true; }
 		else if (strcmp(argv[i], "-h") == 0) { print_help(); return 0; }
 	}
 
-	cimg::exception_mode(0);
+	if ((options.hist_kernel != "simple") && (options.hist_kernel != "local") && (options.hist_kernel != "replicated")) {
+		std::cerr << "Unknown histogram kernel: " << options.hist_kernel << std::endl;
+		print_help();
+		return 1;
+	}
 
-	//detect any potential exceptions
-	try {
-		CImg<unsigned char> image_input(image_filename.c_str());
-		CImgDisplay disp_input(image_input,"input");
+	if ((options.scan_mode != "single") && (options.scan_mode != "hierarchical") && (options.scan_mode != "lookback")) {
+		std::cerr << "Unknown scan mode: " << options.scan_mode << std::endl;
+		print_help();
+		return 1;
+	}
 
-		//a 3x3 convolution mask implementing an averaging filter
-		std::vector<float> convolution_mask = { 1.f / 9, 1.f / 9, 1.f / 9,
-												1.f / 9, 1.f / 9, 1.f / 9,
-												1.f / 9, 1.f / 9, 1.f / 9 };
+	if ((options.colour_mode != "luma") && (options.colour_mode != "joint")) {
+		std::cerr << "Unknown colour mode: " << options.colour_mode << std::endl;
+		print_help();
+		return 1;
+	}
 
-		//Part 3 - host operations
-		//3.1 Select computing devices
+	if ((options.clahe_tiles_x < 0) || (options.clahe_tiles_y < 0) || ((options.clahe_tiles_x == 0) != (options.clahe_tiles_y == 0))) {
+		std::cerr << "Invalid CLAHE tile grid, expected WxH" << std::endl;
+		print_help();
+		return 1;
+	}
+
+	if ((!options.match_file.empty() + (options.clahe_tiles_x > 0) + options.auto_levels) > 1) {
+		std::cerr << "-match, -clahe and -levels cannot be combined" << std::endl;
+		print_help();
+		return 1;
+	}
 
-		typedef int custom_int; std::vector<custom_int> H_bin(256);
-		std::vector<custom_int> CH_bin(256);
-		size_t h_size = H_bin.size() * sizeof(custom_int);
+	if ((options.otsu_thresholds > 0) && (options.clahe_tiles_x > 0)) {
+		std::cerr << "-otsu needs a global LUT and cannot be combined with -clahe" << std::endl;
+		print_help();
+		return 1;
+	}
+
+	if ((options.lut_mode != "auto") && (options.lut_mode != "double") && (options.lut_mode != "fixed")) {
+		std::cerr << "Unknown LUT mode: " << options.lut_mode << std::endl;
+		print_help();
+		return 1;
+	}
 
-		std::vector<custom_int> LH_bin(256);
-		std::vector<custom_int> nr_bins(256);
+	if ((options.vec_width < 0) || (options.vec_width > 16) || (options.vec_width & (options.vec_width - 1))) {
+		std::cerr << "Unsupported vector width: " << options.vec_width << std::endl;
+		print_help();
+		return 1;
+	}
 
-		std::vector<custom_int> LUT_table(256);
+	/* Explicit kernel choices -> run as asked, the fused kernel is only picked automatically for the default pipeline */
+	if (!fuse_given && ((options.hist_kernel != "simple") || (options.scan_mode != "single") || (options.vec_width != 0) || options.use_images)) {
+		options.fused_max_pixels = 0;
+	}
 
-		std::vector<custom_int> H_local_bin(256);
+	cimg::exception_mode(0);
 
+	//detect any potential exceptions
+	try {
+		//Part 3 - host operations
+		//3.1 Select computing devices
 		cl::Context context = GetContext(platform_id, device_id);
 
 		//display the selected device
@@ -74,136 +1983,116 @@ int main(int argc, char **argv) {
 		//create a queue to which we will push commands for the device
 		cl::CommandQueue queue(context, CL_QUEUE_PROFILING_ENABLE);
 
-		//3.2 Load & build the device code
-		cl::Program::Sources sources;
-
-		AddSources(sources, "kernels/my_kernels.cl");
+		/* LUT arithmetic -> the double precision kernels are only built on devices with cl_khr_fp64 */
+		bool has_fp64 = device_has_fp64(context.getInfo<CL_CONTEXT_DEVICES>()[0]);
+		if ((options.lut_mode == "double") && !has_fp64) { std::cout << "The device has no double precision support, using the fixed-point LUT" << std::endl; }
+		options.fixed_point_lut = (options.lut_mode == "fixed") || !has_fp64;
 
-		cl::Program program(context, sources);
-
-		//build and debug the kernel code
-		try { 
-			program.build();
-		}
-		catch (const cl::Error& err) {
-			std::cout << "Build Status: " << program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
-			std::cout << "Build Options:\t" << program.getBuildInfo<CL_PROGRAM_BUILD_OPTIONS>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
-			std::cout << "Build Log:\t " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
-			throw err;
+		/* Image back end -> buffers only on devices without image support */
+		if (options.use_images && !context.getInfo<CL_CONTEXT_DEVICES>()[0].getInfo<CL_DEVICE_IMAGE_SUPPORT>()) {
+			std::cout << "The device has no image support, using buffers" << std::endl;
+			options.use_images = false;
 		}
 
-		//Part 4 - device operations
-
-		//device - buffers
-		cl::Buffer dev_image_input(context, CL_MEM_READ_ONLY, image_input.size());
-		cl::Buffer dev_image_output(context, CL_MEM_READ_WRITE, image_input.size()); //should be the same as input image
-
-		/* Histogram Buffers */
-		cl::Buffer dev_hist_simple_output(context, CL_MEM_READ_WRITE, h_size);
-		//cl::Buffer dev_hist_local_simple_output(context, CL_MEM_READ_WRITE, h_size);
-		cl::Buffer dev_hist_cumulative_output(context, CL_MEM_READ_WRITE, h_size);
-		cl::Buffer dev_lut_output(context, CL_MEM_READ_WRITE, h_size);
-
-		/* Events to measure the execution times. */
-		cl::Event prof_event_simple;
-
-		cl::Event prof_event_cumulative;
-
-		cl::Event prof_event_local_simple;
-
-		cl::Event prof_event_lut;
-
-		cl::Event prof_event_redirective;
+		/* Replicated histogram -> R copies of the 256 bins must fit in the local memory of a work-group */
+		int max_replicas = (int)std::max<cl_ulong>(1, context.getInfo<CL_CONTEXT_DEVICES>()[0].getInfo<CL_DEVICE_LOCAL_MEM_SIZE>() / (INT_BIN_SIZE * sizeof(int)));
+		if (options.hist_replicas > max_replicas) {
+			std::cout << "At most " << max_replicas << " sub-histograms fit in the local memory of the device, using " << max_replicas << std::endl;
+			options.hist_replicas = max_replicas;
+		}
 
-		//4.1 Copy images to device memory
-		queue.enqueueWriteBuffer(dev_image_input, CL_TRUE, 0, image_input.size(), &image_input.data()[0]);
-		queue.enqueueFillBuffer(dev_hist_simple_output, 0, 0, h_size);
+		//3.2 Load & build the device code
+		if (options.vec_width == 0) { options.vec_width = preferred_vector_width(context.getInfo<CL_CONTEXT_DEVICES>()[0]); }
 
-		//4.2 Setup and execute the kernel (i.e. device code)
+		string build_options = "-DHIST_REPLICAS=" + std::to_string(options.hist_replicas) + " -DVEC_WIDTH=" + std::to_string(options.vec_width)
+			+ " -DSCAN_ITEMS=" + std::to_string(SCAN_ITEMS) + " -DQUANTILE_ONE=" + std::to_string(QUANTILE_ONE);
 
-		/* This line uses Intensity Histogram to describe the distribution of the frequency of each pixel from 0 to 255. */
-		//size_t local_size = 256;
+		//compiled binaries are kept in program_cache_dir and reused while the source, options and device are unchanged
+		cl::Program program = BuildProgramCached(context, "kernels/my_kernels.cl", build_options, program_cache_dir);
 
-		cl::Kernel kernel_hist_simple = cl::Kernel(program, "hist_simple");
-		kernel_hist_simple.setArg(0, dev_image_input);
-		kernel_hist_simple.setArg(1, dev_hist_simple_output);
-		//kernel_hist_simple.setArg(2, cl::Local(local_size * sizeof(custom_int)));
+		if (benchmark) {
+			benchmark_histograms(context, queue, program, options.hist_replicas, options.vec_width);
+			benchmark_scan(context, queue, program);
+			benchmark_ranged_histogram(context, queue, program);
+			benchmark_clahe(context, queue, program);
+			benchmark_convolution(context, queue, program);
+			benchmark_images(context, queue, program, options.vec_width);
+			validate_lut(context, queue, program);
 
-		/* Simple Histogram Buffers */
-		queue.enqueueNDRangeKernel(kernel_hist_simple, cl::NullRange, cl::NDRange(image_input.size()), cl::NullRange, NULL, &prof_event_simple);
-		queue.enqueueReadBuffer(dev_hist_simple_output, CL_TRUE, 0, h_size, &H_bin[0]);
+			//one program per element type and bin count, cached like my_kernels.cl
+			HistogramEngine engine(context, "kernels/histogram_generic.cl", program_cache_dir);
+			benchmark_generic_histograms(context, queue, engine);
 
-		//queue.enqueueFillBuffer(dev_hist_local_simple_output, CL_TRUE, 0, h_size);
+			StatsEngine stats_engine(context, "kernels/stats_generic.cl", program_cache_dir);
+			benchmark_stats(context, queue, stats_engine);
+			return 0;
+		}
 
-		/* Local Memory Histogram */
-		//cl::Kernel kernel_hist_local_simple = cl::Kernel(program, "hist_local_simple");
-		//kernel_hist_local_simple.setArg(0, dev_image_input);
-		////kernel_hist_local_simple.setArg(1, cl::Local(h_size));
-		//kernel_hist_local_simple.setArg(1, dev_hist_local_simple_output);
-		//kernel_hist_local_simple.setArg(2, H_local_bin);
+		EqualiseBuffers buffers(context, program_cache_dir);
 
-		/* Cumulative Histogram Buffers */
-		queue.enqueueFillBuffer(dev_hist_cumulative_output, 0, 0, h_size);
+		//a 3x3 convolution mask implementing an averaging filter
+		std::vector<float> convolution_mask = { 1.f / 9, 1.f / 9, 1.f / 9,
+												1.f / 9, 1.f / 9, 1.f / 9,
+												1.f / 9, 1.f / 9, 1.f / 9 };
 
-		/* Cumulative Histogram */
-		cl::Kernel kernel_cumulative = cl::Kernel(program, "hist_cumulative");
-		kernel_cumulative.setArg(0, dev_hist_simple_output);
-		kernel_cumulative.setArg(1, dev_hist_cumulative_output);
+		/* Denoising -> the mask is uploaded once to constant memory and applied on the device after every upload */
+		if (options.blur_sigma > 0.0f) { buffers.set_separable(gaussian_weights(options.blur_sigma), gaussian_weights(options.blur_sigma)); }
+		else if (options.denoise) { buffers.set_mask(convolution_mask); }
 
-		/* LUT buffer */
-		queue.enqueueFillBuffer(dev_lut_output, 0, 0, h_size);
+		/* Auto-levels -> the quantiles are uploaded once */
+		if (options.auto_levels) { buffers.set_levels(options.levels_low, options.levels_high); }
 
-		/* LUT */
-		cl::Kernel kernel_lut_table = cl::Kernel(program, "LUT_table");
-		kernel_lut_table.setArg(0, dev_image_input);
-		kernel_lut_table.setArg(1, dev_lut_output);
+		/* Histogram matching -> the reference CDF is computed once and kept on the device for every image */
+		if (!options.match_file.empty()) { load_match_reference(queue, program, options, buffers); }
 
-		/* LUT redirective */
-		cl::Kernel kernel_lut_redirective = cl::Kernel(program, "LUT_redirective");
-		kernel_lut_redirective.setArg(0, dev_image_input);
-		kernel_lut_redirective.setArg(1, dev_lut_output);
-		kernel_lut_redirective.setArg(2, dev_image_output);
+		if (!batch_path.empty()) {
+			/* Batch mode -> one context, queue and program for every image, device buffers reused */
+			equalise_batch(queue, program, options, buffers, batch_path, output_dir);
+			return 0;
+		}
 
-		queue.enqueueNDRangeKernel(kernel_cumulative, cl::NullRange, cl::NDRange(h_size), cl::NullRange, NULL, &prof_event_cumulative);
-		queue.enqueueReadBuffer(dev_hist_cumulative_output, CL_TRUE, 0, h_size, &CH_bin[0]);
+		/* 16-bit input -> PGM/PPM files with a maximum value above 255 */
+		int max_value = pnm_max_value(image_filename);
 
-		/* Local Simple Histogram Queue */
-		/*queue.enqueueNDRangeKernel(kernel_hist_local_simple, cl::NullRange, cl::NDRange(image_input.size()), cl::NullRange, NULL, &prof_event_local_simple);
-		queue.enqueueReadBuffer(dev_hist_local_simple_output, CL_TRUE, 0, h_size, &H_local_bin[0]);*/
+		//Part 4 - device operations
+		if (max_value > 255) {
+			CImg<unsigned short> image_input(image_filename.c_str());
+			vector<unsigned short> output_buffer(image_input.size());
 
-		/* LUT queues */
-		queue.enqueueNDRangeKernel(kernel_lut_table, cl::NullRange, cl::NDRange(image_input.size()), cl::NullRange, NULL, &prof_event_lut);
-		queue.enqueueReadBuffer(dev_lut_output, CL_TRUE, 0, h_size, &LUT_table[0]);
+			auto start_time = std::chrono::high_resolution_clock::now();
 
-		vector<unsigned char> output_buffer(image_input.size());
-		//4.3 Copy the result from device to host
-		//queue.enqueueReadBuffer(dev_image_output, CL_TRUE, 0, output_buffer.size(), &output_buffer.data()[0]);
+			equalise_image_16(queue, program, options, buffers, image_input, max_value, output_buffer);
 
-		/* Redirective LUT */
-		queue.enqueueNDRangeKernel(kernel_lut_redirective, cl::NullRange, cl::NDRange(image_input.size()), cl::NullRange, NULL, &prof_event_redirective);
-		queue.enqueueReadBuffer(dev_image_output, CL_TRUE, 0, output_buffer.size(), &output_buffer.data()[0]);
+			std::cout << "End-to-end wall time (upload to output read) in ms: " << std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start_time).count() << "\n";
 
-		/* Information regarding execution times and the size of bins required. */
+			if (options.channel_stats) { std::cout << "Input statistics : " << image_stats<unsigned short>(queue, buffers, image_input.size()) << "\n"; }
 
-		std::cout << "Histogram [simple] : " << H_bin << "\t" << "kernel exec. time in ns: " << prof_event_simple.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event_simple.getProfilingInfo<CL_PROFILING_COMMAND_START>() << "\n";
+			display_images(image_input, CImg<unsigned short>(output_buffer.data(), image_input.width(), image_input.height(), image_input.depth(), image_input.spectrum()));
+		}
+		else {
+			CImg<unsigned char> image_input(image_filename.c_str());
+			vector<unsigned char> output_buffer(image_input.size());
 
-		/*std::cout << "Histogram [simple using local privisatiation] : " << H_local_bin << "\t" << "kernel exec. time in ns: " << prof_event_local_simple.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event_local_simple.getProfilingInfo<CL_PROFILING_COMMAND_START>() << "\n";*/
+			auto start_time = std::chrono::high_resolution_clock::now();
 
-		//prof_event_simple.getProfilingInfo<CL_PROFILING_CS>();
+			equalise_image(queue, program, options, buffers, image_input, output_buffer);
 
-		std::cout << "Histogram [cumulative] : " << CH_bin << "\t" << "kernel exec. time in ns: " << prof_event_cumulative.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event_cumulative.getProfilingInfo<CL_PROFILING_COMMAND_START>() << "\n";
+			std::cout << "End-to-end wall time (upload to output read) in ms: " << std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start_time).count() << "\n";
 
-		std::cout << "Histogram [normalised & LUT] : " << LUT_table << "\t" << "kernel exec. time in ns: " << prof_event_lut.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event_lut.getProfilingInfo<CL_PROFILING_COMMAND_START>() << "\n";
+			if (options.channel_stats) {
+				std::cout << "Input statistics : " << image_stats<unsigned char>(queue, buffers, image_input.size()) << "\n";
 
-		CImg<unsigned char> output_image(output_buffer.data(), image_input.width(), image_input.height(), image_input.depth(), image_input.spectrum());
-		CImgDisplay disp_output(output_image,"output");
+				std::vector<int> H, CH;
+				channel_histograms(queue, program, buffers, image_input, H, CH);
 
- 		while (!disp_input.is_closed() && !disp_output.is_closed()
-			&& !disp_input.is_keyESC() && !disp_output.is_keyESC()) {
-		    disp_input.wait(1);
-		    disp_output.wait(1);
-	    }		
+				for (int c = 0; c < image_input.spectrum(); c++) {
+					std::cout << "Channel " << c << " histogram : " << std::vector<int>(H.begin() + c * INT_BIN_SIZE, H.begin() + (c + 1) * INT_BIN_SIZE) << "\n";
+					std::cout << "Channel " << c << " cumulative : " << std::vector<int>(CH.begin() + c * INT_BIN_SIZE, CH.begin() + (c + 1) * INT_BIN_SIZE) << "\n";
+				}
+			}
 
+			display_images(image_input, CImg<unsigned char>(output_buffer.data(), image_input.width(), image_input.height(), image_input.depth(), image_input.spectrum()));
+		}
 	}
 	catch (const cl::Error& err) {
 		std::cerr << "ERROR: " << err.what() << ", " << getErrorString(err.err()) << std::endl;
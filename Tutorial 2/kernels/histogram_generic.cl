@@ -0,0 +1,60 @@
+/*Generic histogram kernel, specialised at build time (see HistogramEngine in Utils.h)*/
+
+/* HIST_T    : element type, uchar | ushort | int | float
+   HIST_BINS : number of bins over [min_value, max_value)
+   HIST_FLOAT: 1 for floating point elements (bin from a scale factor), 0 for integers (exact integer maths)
+   HIST_LOCAL: 1 if HIST_BINS ints fit in local memory (privatised histogram), 0 to count in global memory */
+#ifndef HIST_T
+#define HIST_T uchar
+#endif
+
+#ifndef HIST_BINS
+#define HIST_BINS 256
+#endif
+
+#ifndef HIST_FLOAT
+#define HIST_FLOAT 0
+#endif
+
+#ifndef HIST_LOCAL
+#define HIST_LOCAL 1
+#endif
+
+/* Bin of a value already known to lie in [min_value, max_value). */
+int bin_index(HIST_T value, HIST_T min_value, HIST_T max_value) {
+#if HIST_FLOAT
+	int bin = (int)((value - min_value) * (HIST_BINS / (float)(max_value - min_value)));
+	return min(bin, HIST_BINS - 1); //rounding can push values just below max_value into bin HIST_BINS
+#else
+	return (int)(((long)value - min_value) * HIST_BINS / ((long)max_value - min_value));
+#endif
+}
+
+/* Histogram of N values, values outside [min_value, max_value) are not counted. H must be zeroed beforehand.
+   Work-items stride over the input, so any global size works. */
+kernel void hist_generic(global const HIST_T* A, global int* H, int N, HIST_T min_value, HIST_T max_value) {
+	int lid = get_local_id(0); int l_size = get_local_size(0);
+
+#if HIST_LOCAL
+	local int LH[HIST_BINS];
+
+	for (int i = lid; i < HIST_BINS; i += l_size) { LH[i] = 0; }
+	barrier(CLK_LOCAL_MEM_FENCE);
+#define COUNTS LH
+#else
+#define COUNTS H
+#endif
+
+	for (int i = get_global_id(0); i < N; i += get_global_size(0)) {
+		HIST_T value = A[i];
+		if ((value >= min_value) && (value < max_value)) { atomic_inc(&COUNTS[bin_index(value, min_value, max_value)]); }
+	}
+
+#if HIST_LOCAL
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int i = lid; i < HIST_BINS; i += l_size) {
+		if (LH[i] != 0) { atomic_add(&H[i], LH[i]); }
+	}
+#endif
+}
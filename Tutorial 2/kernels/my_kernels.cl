@@ -2,30 +2,43 @@
 
 /*Many Bins Histogram -> https://stackoverflow.com/questions/27947178/opencl-histogram-with-many-bins */
 
-#define RANGE_SIZE 8192
-
-//kernel void hist_test(global uint a, constant int a_size) {
-//	int wid = get_local_id(0);
-//	int w_size = get_local_size(0);
-//
-//	int gid = get_group_id(0);
-//	int n_groups = get_num_groups(0);
-//
-//	int range_begin = gid * RANGE_SIZE / n_groups;
-//	int range_end = (gid + 1) * RANGE_SIZE / n_groups;
-//
-//	local uint tmp_hist[RANGE_SIZE]; uint value;
-//
-//	for (int i = wid; i < a_size; += w_size) {
-//		value = a[i];
-//
-//		if (value >= range_begin && value < range_end) {
-//			atomic_inc(tmp_hist[value - range_begin]);
-//		}
-//	}
-//
-//	barrier(CLK_GLOBAL_MEM_FENCE);
-//}
+/* Range-partitioned histogram for bin counts far beyond local memory (64K - 1M bins, 32-bit feature IDs):
+   get_group_id(1) selects the slice [slice * range_size, (slice + 1) * range_size) of bins held in local memory
+   (LH, range_size ints, sized by EnqueueHistogramRanged from CL_DEVICE_LOCAL_MEM_SIZE) and get_group_id(0) the
+   chunk of chunk_size input values the group streams through, counting only those of its slice. Values at or
+   above nr_bins are ignored. Every group merges its slice into H with one atomic_add per non-empty bin. */
+void hist_ranged_clear(local int* LH, int range_size) {
+	for (int i = get_local_id(0); i < range_size; i += get_local_size(0)) { LH[i] = 0; }
+	barrier(CLK_LOCAL_MEM_FENCE);
+}
+
+void hist_ranged_merge(local int* LH, global int* H, uint range_begin, uint range_length) {
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for (uint i = get_local_id(0); i < range_length; i += get_local_size(0)) {
+		if (LH[i] != 0) { atomic_add(&H[range_begin + i], LH[i]); }
+	}
+}
+
+//one kernel body per element type, hist_ranged_uint and hist_ranged_ushort
+#define HIST_RANGED_KERNEL(T) \
+kernel void hist_ranged_##T(global const T* A, global int* H, local int* LH, int N, int nr_bins, int range_size, int chunk_size) { \
+	uint range_begin = get_group_id(1) * range_size; \
+	uint range_length = min((uint)range_size, (uint)nr_bins - range_begin); \
+	int chunk_begin = get_group_id(0) * chunk_size; \
+	int chunk_end = min(chunk_begin + chunk_size, N); \
+\
+	hist_ranged_clear(LH, range_size); \
+\
+	for (int i = chunk_begin + get_local_id(0); i < chunk_end; i += get_local_size(0)) { \
+		uint offset = A[i] - range_begin; /* wraps around for values below the slice */ \
+		if (offset < range_length) { atomic_inc(&LH[offset]); } \
+	} \
+\
+	hist_ranged_merge(LH, H, range_begin, range_length); \
+}
+
+HIST_RANGED_KERNEL(uint)
+HIST_RANGED_KERNEL(ushort)
 
 kernel void hist_atomic(global const int* A, local int* H, int nr_bins) {
 	int id = get_global_id(0);
@@ -40,20 +53,76 @@ kernel void hist_atomic(global const int* A, local int* H, int nr_bins) {
 	atomic_inc(&H[bin_index]);
 }
 
-kernel void hist_local_simple(global const uchar* A, global int* H, int nr_bins) {
-	int id = get_global_id(0); int lid = get_local_id(0);
-
-	int bin_index = A[id];
+/* Privatised histogram: every work-group builds its own copy of H in local memory
+   and merges it into the global H with one atomic_add per bin. */
+kernel void hist_local_simple(global const uchar* A, global int* H, local int* LH, int nr_bins, int N) {
+	int id = get_global_id(0);
+	int lid = get_local_id(0); int l_size = get_local_size(0);
 
 	//	Clearing the scratch bins..
-	if (lid < nr_bins) { H[lid] = 0; }
+	for (int i = lid; i < nr_bins; i += l_size) { LH[i] = 0; }
 
 	barrier(CLK_LOCAL_MEM_FENCE);
 
-	atomic_inc(&H[bin_index]);
-	//barrier(CLK_LOCAL_MEM_FENCE);
+	//	the global size is padded up to a multiple of the work-group size
+	if (id < N) { atomic_inc(&LH[A[id]]); }
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	//	one global update per non-empty bin instead of one per pixel
+	for (int i = lid; i < nr_bins; i += l_size) {
+		if (LH[i] != 0) { atomic_add(&H[i], LH[i]); }
+	}
+}
+
+/* Per-channel histograms of a planar image in one pass: C channels of N pixels each (CImg layout, channel stride N).
+   Every work-item reads its pixel in all C channels and counts into a C x nr_bins local histogram; H receives the
+   C histograms back to back (channel c in H[c * nr_bins] .. H[(c + 1) * nr_bins - 1]). */
+kernel void hist_channels(global const uchar* A, global int* H, local int* LH, int nr_bins, int N, int C) {
+	int id = get_global_id(0);
+	int lid = get_local_id(0); int l_size = get_local_size(0);
+
+	for (int i = lid; i < C * nr_bins; i += l_size) { LH[i] = 0; }
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (id < N) {
+		for (int c = 0; c < C; c++) { atomic_inc(&LH[c * nr_bins + A[c * N + id]]); }
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int i = lid; i < C * nr_bins; i += l_size) {
+		if (LH[i] != 0) { atomic_add(&H[i], LH[i]); }
+	}
+}
+
+/* Number of sub-histograms kept by every work-group, set with -DHIST_REPLICAS=R in program.build(). */
+#ifndef HIST_REPLICAS
+#define HIST_REPLICAS 8
+#endif
+
+/* Replicated histogram: like hist_local_simple, but the local histogram is split into HIST_REPLICAS
+   interleaved copies (LH[bin * HIST_REPLICAS + r]) so that neighbouring work-items hitting the same
+   bin update different counters (and banks). Pays off on low-entropy images where most pixels share a few bins. */
+kernel void hist_local_replicated(global const uchar* A, global int* H, local int* LH, int nr_bins, int N) {
+	int id = get_global_id(0);
+	int lid = get_local_id(0); int l_size = get_local_size(0);
+
+	for (int i = lid; i < nr_bins * HIST_REPLICAS; i += l_size) { LH[i] = 0; }
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (id < N) { atomic_inc(&LH[A[id] * HIST_REPLICAS + lid % HIST_REPLICAS]); }
 
-	//if (id < nr_bins) { atomic_add(&H[lid], LH[lid]); }
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	//	reduce the replicas and merge into the global histogram
+	for (int i = lid; i < nr_bins; i += l_size) {
+		int sum = 0;
+		for (int r = 0; r < HIST_REPLICAS; r++) { sum += LH[i * HIST_REPLICAS + r]; }
+		if (sum != 0) { atomic_add(&H[i], sum); }
+	}
 }
 
 //a very simple histogram implementation
@@ -84,27 +153,561 @@ kernel void hist_serial(global const int* A, global int* H) {
 	barrier(CLK_GLOBAL_MEM_FENCE);
 }
 
-kernel void hist_cumulative(global int* H, global int* CH) {
+/* Work-efficient (Blelloch) exclusive scan of the l_size values in S, in place: an up-sweep builds
+   partial sums in a balanced tree, a down-sweep distributes them back. l_size must be a power of two.
+   Every work-item of the group must call it; it returns the total of all the values. */
+int scan_local_exclusive(local int* S, int lid, int l_size) {
+	//	up-sweep (reduce)
+	for (int stride = 1; stride < l_size; stride *= 2) {
+		barrier(CLK_LOCAL_MEM_FENCE);
+		int i = (lid + 1) * stride * 2 - 1;
+		if (i < l_size) { S[i] += S[i - stride]; }
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+	int total = S[l_size - 1];
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (lid == 0) { S[l_size - 1] = 0; }
+
+	//	down-sweep
+	for (int stride = l_size / 2; stride > 0; stride /= 2) {
+		barrier(CLK_LOCAL_MEM_FENCE);
+		int i = (lid + 1) * stride * 2 - 1;
+		if (i < l_size) {
+			int t = S[i - stride];
+			S[i - stride] = S[i];
+			S[i] += t;
+		}
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	return total;
+}
+
+/* Cumulative histogram (inclusive or exclusive prefix sum of H) computed by a single work-group of
+   power-of-two size: each work-item sums a contiguous chunk of bins, the chunk sums are scanned in
+   local memory (S holds one int per work-item) and each chunk is then written out with its offset.
+   Works for any nr_bins (256 for 8-bit, 65536 for 16-bit images); when launched with several groups,
+   group g scans the g-th histogram of nr_bins stored back to back. */
+kernel void hist_cumulative(global const int* H, global int* CH, local int* S, int nr_bins, int inclusive) {
+	int lid = get_local_id(0); int l_size = get_local_size(0);
+	int offset = get_group_id(0) * nr_bins;
+
+	int chunk = (nr_bins + l_size - 1) / l_size;
+	int begin = min(lid * chunk, nr_bins); int end = min(begin + chunk, nr_bins);
+
+	int sum = 0;
+	for (int i = begin; i < end; i++) { sum += H[offset + i]; }
+	S[lid] = sum;
+
+	scan_local_exclusive(S, lid, l_size);
+
+	int running = S[lid];
+	for (int i = begin; i < end; i++) {
+		if (inclusive) { running += H[offset + i]; CH[offset + i] = running; }
+		else { CH[offset + i] = running; running += H[offset + i]; }
+	}
+}
+
+/* Hierarchical scan for arrays that do not fit in one work-group (see EnqueueScan in Utils.h).
+   Every work-item owns SCAN_ITEMS consecutive elements, so a work-group covers a block of l_size * SCAN_ITEMS.
+   Set with -DSCAN_ITEMS=n in program.build() from the host definition in Utils.h; the default is the same value. */
+#ifndef SCAN_ITEMS
+#define SCAN_ITEMS 4
+#endif
+
+/* Level 1: scans every block independently and stores the block totals in block_sums. A and B may alias. */
+kernel void scan_blocks(global const int* A, global int* B, global int* block_sums, local int* S, int N, int inclusive) {
+	int lid = get_local_id(0); int l_size = get_local_size(0);
+	int base = get_global_id(0) * SCAN_ITEMS;
+
+	int v[SCAN_ITEMS]; int sum = 0;
+	for (int k = 0; k < SCAN_ITEMS; k++) {
+		v[k] = (base + k < N) ? A[base + k] : 0;
+		sum += v[k];
+	}
+	S[lid] = sum;
+
+	int total = scan_local_exclusive(S, lid, l_size);
+
+	int running = S[lid];
+	for (int k = 0; (k < SCAN_ITEMS) && (base + k < N); k++) {
+		if (inclusive) { running += v[k]; B[base + k] = running; }
+		else { B[base + k] = running; running += v[k]; }
+	}
+
+	if (lid == 0) { block_sums[get_group_id(0)] = total; }
+}
+
+/* Level 2: adds the exclusive scan of the block sums back to every element of the block. Same launch geometry as scan_blocks. */
+kernel void scan_add_offsets(global int* B, global const int* offsets, int N) {
+	int base = get_global_id(0) * SCAN_ITEMS;
+	int offset = offsets[get_group_id(0)];
+
+	for (int k = 0; (k < SCAN_ITEMS) && (base + k < N); k++) { B[base + k] += offset; }
+}
+
+/* Single-pass scan with decoupled look-back (see EnqueueScan in Utils.h). Tiles of l_size * SCAN_ITEMS
+   elements are handed out in launch order through tile_counter, so every tile only waits on tiles that
+   are already running. A tile publishes its own total (TILE_AGGREGATE) straight away, then walks back
+   over its predecessors adding their totals until it meets one with a published prefix (TILE_PREFIX),
+   and finally publishes its own inclusive prefix. tile_flags and tile_counter must be zeroed before
+   the launch; tile_values holds the aggregate and the inclusive prefix of every tile. */
+#define TILE_INVALID 0
+#define TILE_AGGREGATE 1
+#define TILE_PREFIX 2
+
+kernel void scan_lookback(global const int* A, global int* B, global volatile int* tile_flags, global volatile int* tile_values,
+	global int* tile_counter, local int* S, int N, int inclusive) {
+	int lid = get_local_id(0); int l_size = get_local_size(0);
+	local int tile_id; local int tile_prefix;
+
+	if (lid == 0) { tile_id = atomic_inc(tile_counter); }
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	int tile = tile_id;
+	int base = (tile * l_size + lid) * SCAN_ITEMS;
+
+	int v[SCAN_ITEMS]; int sum = 0;
+	for (int k = 0; k < SCAN_ITEMS; k++) {
+		v[k] = (base + k < N) ? A[base + k] : 0;
+		sum += v[k];
+	}
+	S[lid] = sum;
+
+	int total = scan_local_exclusive(S, lid, l_size);
+
+	if (lid == 0) {
+		int prefix = 0;
+
+		if (tile == 0) {
+			tile_values[1] = total;
+			write_mem_fence(CLK_GLOBAL_MEM_FENCE);
+			atomic_xchg(&tile_flags[0], TILE_PREFIX);
+		}
+		else {
+			tile_values[2 * tile] = total;
+			write_mem_fence(CLK_GLOBAL_MEM_FENCE);
+			atomic_xchg(&tile_flags[tile], TILE_AGGREGATE);
+
+			//	look-back
+			for (int j = tile - 1; j >= 0; j--) {
+				int flag;
+				do { flag = atomic_or(&tile_flags[j], 0); } while (flag == TILE_INVALID);
+				read_mem_fence(CLK_GLOBAL_MEM_FENCE);
+
+				if (flag == TILE_PREFIX) { prefix += tile_values[2 * j + 1]; break; }
+				prefix += tile_values[2 * j];
+			}
+
+			tile_values[2 * tile + 1] = prefix + total;
+			write_mem_fence(CLK_GLOBAL_MEM_FENCE);
+			atomic_xchg(&tile_flags[tile], TILE_PREFIX);
+		}
+
+		tile_prefix = prefix;
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	int running = S[lid] + tile_prefix;
+	for (int k = 0; (k < SCAN_ITEMS) && (base + k < N); k++) {
+		if (inclusive) { running += v[k]; B[base + k] = running; }
+		else { B[base + k] = running; running += v[k]; }
+	}
+}
+
+/* True if bin id of an inclusive cumulative histogram holds every count (it is the first non-zero bin and the only one),
+   or the histogram is empty. Such a bin keeps its value: scaling would send a flat image to nr_bins - 1. */
+bool lut_degenerate(global const int* cumulative_hist, int id, int nr_bins) {
+	int total = cumulative_hist[nr_bins - 1];
+	return (total == 0) || ((cumulative_hist[id] == total) && ((id == 0) || (cumulative_hist[id - 1] == 0)));
+}
+
+/* Integer LUT value, floor(CH[id] * (nr_bins - 1) / CH[nr_bins - 1]) with a 64-bit product: exact, and bit-identical
+   to the double precision quotient truncated by LUT_table (with CH below 2^31 the product is exact in a double and the
+   correctly rounded quotient cannot reach the next integer). Needs no floating point at all. */
+int lut_value_fixed(global const int* cumulative_hist, int id, int nr_bins) {
+	if (lut_degenerate(cumulative_hist, id, nr_bins)) { return id; }
+
+	return (int)((long)cumulative_hist[id] * (nr_bins - 1) / cumulative_hist[nr_bins - 1]);
+}
+
+#ifdef cl_khr_fp64
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+
+/* LUT look-up table, one work-item per bin: scales the inclusive cumulative histogram to [0, nr_bins - 1] */
+kernel void LUT_table(global const int* cumulative_hist, global int* LUT, int nr_bins) {
 	int id = get_global_id(0);
 
-	int n = get_global_size(0);
+	if (lut_degenerate(cumulative_hist, id, nr_bins)) { LUT[id] = id; return; }
 
-	barrier(CLK_GLOBAL_MEM_FENCE);
+	LUT[id] = cumulative_hist[id] * (double)(nr_bins - 1) / cumulative_hist[nr_bins - 1];
+}
+
+/* LUT_table for 8-bit images, emitting the compact form read by LUT_redirective_compact (one uchar per bin). */
+kernel void LUT_table_uchar(global const int* cumulative_hist, global uchar* LUT, int nr_bins) {
+	int id = get_global_id(0);
+
+	if (lut_degenerate(cumulative_hist, id, nr_bins)) { LUT[id] = id; return; }
+
+	LUT[id] = cumulative_hist[id] * (double)(nr_bins - 1) / cumulative_hist[nr_bins - 1];
+}
+#endif
+
+/* LUT_table and LUT_table_uchar without double precision, for devices without cl_khr_fp64 (same results). */
+kernel void LUT_table_fixed(global const int* cumulative_hist, global int* LUT, int nr_bins) {
+	int id = get_global_id(0);
+
+	LUT[id] = lut_value_fixed(cumulative_hist, id, nr_bins);
+}
+
+kernel void LUT_table_fixed_uchar(global const int* cumulative_hist, global uchar* LUT, int nr_bins) {
+	int id = get_global_id(0);
+
+	LUT[id] = lut_value_fixed(cumulative_hist, id, nr_bins);
+}
+
+/* Quantiles of an inclusive cumulative histogram, one work-item per bin and quantile (2D NDRange nr_bins x quantiles).
+   Quantile k, fractions[k] / QUANTILE_ONE of the total, is the first bin whose cumulative count reaches
+   ceil(fractions[k] * total / QUANTILE_ONE) (at least 1). Exactly one bin has the target between the count of its
+   predecessor and its own, so the search needs neither a loop nor synchronisation. An empty histogram gives bin 0.
+   Set with -DQUANTILE_ONE=n in program.build() from the host definition; the default is the same value. */
+#ifndef QUANTILE_ONE
+#define QUANTILE_ONE (1 << 24)
+#endif
+
+kernel void hist_quantiles(global const int* cumulative_hist, global const int* fractions, global int* Q, int nr_bins) {
+	int i = get_global_id(0); int k = get_global_id(1);
+
+	long total = cumulative_hist[nr_bins - 1];
+	long target = max(((long)fractions[k] * total + QUANTILE_ONE - 1) / QUANTILE_ONE, (long)1);
+	long below = (i > 0) ? cumulative_hist[i - 1] : 0;
+
+	if ((cumulative_hist[i] >= target) && (below < target)) { Q[k] = i; }
+	if ((total == 0) && (i == 0)) { Q[k] = 0; }
+}
+
+/* Auto-levels LUT, one work-item per bin: a linear stretch of [Q[0], Q[1]] onto [0, nr_bins - 1], rounded to nearest
+   and clipped outside the range. If the range is empty (Q[1] <= Q[0], e.g. a flat image) the LUT is the identity. */
+kernel void LUT_stretch(global const int* Q, global int* LUT, int nr_bins) {
+	int id = get_global_id(0);
+	int low = Q[0], high = Q[1];
+
+	if (high <= low) { LUT[id] = id; return; }
+
+	long span = high - low;
+	LUT[id] = (int)clamp(((long)(id - low) * (nr_bins - 1) + span / 2) / span, (long)0, (long)(nr_bins - 1));
+}
+
+/* Histogram of the image remapped by LUT, from its histogram H alone: the count of bin v moves to LUT[v].
+   One work-item per bin, HR must be zeroed beforehand. */
+kernel void hist_remap(global const int* H, global const int* LUT, global int* HR) {
+	int id = get_global_id(0);
+
+	if (H[id] != 0) { atomic_add(&HR[LUT[id]], H[id]); }
+}
 
-	for (int i = id + 1; i < n; i++) {
-		atomic_add(&CH[i], H[id]);
+/* Inclusive scan of the first moments (v * H[v]) of a histogram on a single power-of-two work-group: every work-item
+   sums a contiguous chunk of bins, the chunk totals are scanned in L (one long per work-item) and each chunk is
+   then written out with its offset. Longs, as the moments of a 16-bit histogram overflow an int. */
+kernel void hist_moments(global const int* H, global long* S, local long* L, int nr_bins) {
+	int lid = get_local_id(0); int l_size = get_local_size(0);
+	int chunk = (nr_bins + l_size - 1) / l_size;
+	int first = min(lid * chunk, nr_bins); int end = min(first + chunk, nr_bins);
+
+	long total = 0;
+	for (int i = first; i < end; i++) { total += (long)i * H[i]; }
+
+	L[lid] = total;
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int stride = 1; stride < l_size; stride *= 2) {
+		long add = (lid >= stride) ? L[lid - stride] : 0;
+
+		barrier(CLK_LOCAL_MEM_FENCE);
+
+		L[lid] += add;
+
+		barrier(CLK_LOCAL_MEM_FENCE);
 	}
 
-	barrier(CLK_GLOBAL_MEM_FENCE);
+	long running = L[lid] - total;
+	for (int i = first; i < end; i++) {
+		running += (long)i * H[i];
+		S[i] = running;
+	}
 }
 
-/* LUT look-up table */
-kernel void LUT_table(global int* cumulative_hist, global int* LUT) {
+/* Otsu scores are doubles where available: near the optimum the between-class variance is flat to about 1e-7
+   relative, below float resolution once the counts pass 2^24. */
+#ifdef cl_khr_fp64
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+typedef double otsu_score;
+#else
+typedef float otsu_score;
+#endif
+
+/* Otsu score of the class of bins (lo, hi] (lo = -1 from bin 0): squared moment over count. The between-class
+   variance is, up to constants, the sum of the scores of all classes, so the best thresholds maximise that sum. */
+otsu_score otsu_class(global const int* CH, global const long* S, int lo, int hi) {
+	otsu_score count = (otsu_score)(CH[hi] - ((lo >= 0) ? CH[lo] : 0));
+	otsu_score moment = (otsu_score)(S[hi] - ((lo >= 0) ? S[lo] : 0));
+
+	return (count > 0) ? moment * (moment / count) : 0;
+}
+
+//keeps the better of two candidates, the smaller code (earlier thresholds) on a tie
+void otsu_keep(otsu_score* best, long* best_code, otsu_score value, long code) {
+	if ((value > *best) || ((value == *best) && (code < *best_code))) { *best = value; *best_code = code; }
+}
+
+/* Otsu and multi-Otsu search, stage 1 of 2, from the inclusive cumulative histogram CH and moments S. The
+   nr_thresholds (1-4) thresholds t1 < ... < tk split the bins into [0, t1], (t1, t2], ..., (tk, nr_bins - 1].
+   One work-item per t1 (nr_thresholds 1) or per (t1, t2) pair (global id t1 * nr_bins + t2), which loops over the
+   remaining thresholds; the global size is padded to the power-of-two work-group size. The thresholds are packed
+   into a code in base nr_bins (t1 most significant), the best value and code of each group go to V and codes. */
+kernel void otsu_search(global const int* CH, global const long* S, global otsu_score* V, global long* codes, local otsu_score* LV, local long* LC, int nr_bins, int nr_thresholds) {
 	int id = get_global_id(0);
+	int lid = get_local_id(0); int l_size = get_local_size(0);
+	int last = nr_bins - 1;
+	int t1 = (nr_thresholds == 1) ? id : id / nr_bins;
+	int t2 = (nr_thresholds == 1) ? last : id % nr_bins;
+	otsu_score best = -1; long best_code = LONG_MAX;
+
+	if ((t1 < t2) && (t2 <= last) && ((nr_thresholds == 1) || (t2 < last))) {
+		otsu_score head = otsu_class(CH, S, -1, t1) + otsu_class(CH, S, t1, t2);
+
+		if (nr_thresholds == 1) { otsu_keep(&best, &best_code, head, t1); }
+		else if (nr_thresholds == 2) { otsu_keep(&best, &best_code, head + otsu_class(CH, S, t2, last), (long)t1 * nr_bins + t2); }
+		else {
+			for (int t3 = t2 + 1; t3 < last; t3++) {
+				otsu_score head3 = head + otsu_class(CH, S, t2, t3);
+				long code3 = ((long)t1 * nr_bins + t2) * nr_bins + t3;
+
+				if (nr_thresholds == 3) { otsu_keep(&best, &best_code, head3 + otsu_class(CH, S, t3, last), code3); continue; }
+
+				for (int t4 = t3 + 1; t4 < last; t4++) {
+					otsu_keep(&best, &best_code, head3 + otsu_class(CH, S, t3, t4) + otsu_class(CH, S, t4, last), code3 * nr_bins + t4);
+				}
+			}
+		}
+	}
 
-	barrier(CLK_GLOBAL_MEM_FENCE);
+	LV[lid] = best; LC[lid] = best_code;
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int stride = l_size / 2; stride > 0; stride /= 2) {
+		if (lid < stride) {
+			otsu_score value = LV[lid]; long code = LC[lid];
+			otsu_keep(&value, &code, LV[lid + stride], LC[lid + stride]);
+			LV[lid] = value; LC[lid] = code;
+		}
+
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	if (lid == 0) { V[get_group_id(0)] = LV[0]; codes[get_group_id(0)] = LC[0]; }
+}
+
+/* Otsu search, stage 2 of 2, on a single power-of-two work-group: the best of the nr_groups candidates of
+   otsu_search, unpacked into the nr_thresholds thresholds T. */
+kernel void otsu_select(global const otsu_score* V, global const long* codes, global int* T, local otsu_score* LV, local long* LC, int nr_groups, int nr_bins, int nr_thresholds) {
+	int lid = get_local_id(0); int l_size = get_local_size(0);
+	otsu_score best = -1; long best_code = LONG_MAX;
+
+	for (int g = lid; g < nr_groups; g += l_size) { otsu_keep(&best, &best_code, V[g], codes[g]); }
+
+	LV[lid] = best; LC[lid] = best_code;
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int stride = l_size / 2; stride > 0; stride /= 2) {
+		if (lid < stride) {
+			otsu_score value = LV[lid]; long code = LC[lid];
+			otsu_keep(&value, &code, LV[lid + stride], LC[lid + stride]);
+			LV[lid] = value; LC[lid] = code;
+		}
+
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	if (lid == 0) {
+		long code = LC[0];
+		for (int k = nr_thresholds - 1; k >= 0; k--) {
+			T[k] = (int)(code % nr_bins);
+			code /= nr_bins;
+		}
+	}
+}
+
+/* Thresholding LUT, one work-item per bin, applied in place on top of the LUT of an earlier stage: the output
+   v = LUT[id] is replaced by the level of its class, the nr_thresholds + 1 classes of T spread evenly over
+   [0, nr_bins - 1] (0 and nr_bins - 1 for a single threshold). */
+kernel void LUT_threshold(global const int* T, global int* LUT, int nr_bins, int nr_thresholds) {
+	int id = get_global_id(0);
+	int v = LUT[id];
+
+	int level = 0;
+	for (int k = 0; k < nr_thresholds; k++) { level += (v > T[k]); }
 
-	LUT[id] = cumulative_hist[id] * (double)255 / cumulative_hist[255];
+	LUT[id] = level * (nr_bins - 1) / nr_thresholds;
+}
+
+/* Histogram matching LUT, one work-item per bin: bin i goes to the first reference bin whose normalised cumulative
+   count reaches the normalised cumulative count of bin i in the target (the inverse of the reference CDF). The
+   reference CDF is non-decreasing, so every work-item finds its bin with a binary search; the fractions are compared
+   cross-multiplied in 64-bit integers, without rounding. */
+kernel void LUT_match(global const int* cumulative_hist, global const int* reference_cumulative, global int* LUT, int nr_bins) {
+	int id = get_global_id(0);
+
+	long target = cumulative_hist[id];
+	long total = cumulative_hist[nr_bins - 1];
+	long reference_total = reference_cumulative[nr_bins - 1];
+
+	int low = 0, high = nr_bins - 1;
+	while (low < high) {
+		int mid = (low + high) / 2;
+		if (reference_cumulative[mid] * total >= target * reference_total) { high = mid; }
+		else { low = mid + 1; }
+	}
+
+	LUT[id] = low;
+}
+
+/* Fused equalisation for small images: one work-group runs the whole pipeline in a single launch,
+   with barriers between the phases instead of kernel boundaries. H (256 ints) holds the histogram,
+   then the cumulative histogram and finally the LUT; S holds one int per work-item for the scan.
+   Launched as a single work-group of power-of-two size, each work-item strides over the image. */
+kernel void hist_equalise_fused(global const uchar* A, global uchar* B, local int* H, local int* S, int N) {
+	int lid = get_local_id(0); int l_size = get_local_size(0);
+	const int nr_bins = 256;
+	local int flat_bin; //the bin holding all N pixels of a flat image, -1 otherwise
+
+	//	histogram
+	for (int i = lid; i < nr_bins; i += l_size) { H[i] = 0; }
+	if (lid == 0) { flat_bin = -1; }
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int i = lid; i < N; i += l_size) { atomic_inc(&H[A[i]]); }
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int i = lid; i < nr_bins; i += l_size) {
+		if ((H[i] == N) && (N > 0)) { flat_bin = i; }
+	}
+
+	//	inclusive scan, in place: every work-item only rewrites its own chunk
+	int chunk = (nr_bins + l_size - 1) / l_size;
+	int begin = min(lid * chunk, nr_bins); int end = min(begin + chunk, nr_bins);
+
+	int sum = 0;
+	for (int i = begin; i < end; i++) { sum += H[i]; }
+	S[lid] = sum;
+
+	scan_local_exclusive(S, lid, l_size);
+
+	int running = S[lid];
+	for (int i = begin; i < end; i++) { running += H[i]; H[i] = running; }
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	//	LUT, same scaling and flat image case as LUT_table (the last cumulative bin is N)
+	for (int i = lid; i < nr_bins; i += l_size) { H[i] = ((i == flat_bin) || (N == 0)) ? i : (int)(H[i] * (long)(nr_bins - 1) / N); }
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	//	remap
+	for (int i = lid; i < N; i += l_size) { B[i] = H[A[i]]; }
+}
+
+/* CLAHE (contrast-limited adaptive histogram equalisation), stage 1: one work-group per tile of a tiles_x x tiles_y grid
+   (the number of groups in dimensions 0 and 1) and per channel (dimension 2) of a planar image. The tile histogram stays in
+   local memory (H, 256 ints); counts above clip_limit times the mean bin count are clipped and the excess is spread evenly
+   over all bins, then the tile CDF is scanned and stored as a 256-entry uchar LUT in LUTs. LUTs is laid out as
+   [channel][value][tile row][tile column], so the four tiles a pixel blends are neighbours in memory (and LUTs can be
+   copied as is into a 3D image for clahe_remap_image). clip_limit <= 0 disables the clipping (plain AHE). S holds one int per work-item, power-of-two group size up to 256. */
+kernel void clahe_tile_lut(global const uchar* A, global uchar* LUTs, local int* H, local int* S, int width, int height, float clip_limit) {
+	int lid = get_local_id(0); int l_size = get_local_size(0);
+	int tiles_x = get_num_groups(0); int tiles_y = get_num_groups(1);
+	int tx = get_group_id(0); int ty = get_group_id(1); int c = get_group_id(2);
+	const int nr_bins = 256;
+
+	//	tiles partition the image exactly, edge tiles may be one pixel wider or taller
+	int x_begin = tx * width / tiles_x; int x_end = (tx + 1) * width / tiles_x;
+	int y_begin = ty * height / tiles_y; int y_end = (ty + 1) * height / tiles_y;
+	int tile_width = x_end - x_begin; int nr_pixels = tile_width * (y_end - y_begin);
+	global const uchar* P = A + (size_t)c * width * height;
+
+	//	tile histogram
+	for (int i = lid; i < nr_bins; i += l_size) { H[i] = 0; }
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int i = lid; i < nr_pixels; i += l_size) {
+		int y = y_begin + i / tile_width; int x = x_begin + i % tile_width;
+		atomic_inc(&H[P[y * width + x]]);
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	//	clip, the total excess comes out of the scan of the per-work-item excess
+	if (clip_limit > 0.0f) {
+		int clip = max(1, (int)(clip_limit * nr_pixels / nr_bins));
+
+		int excess = 0;
+		for (int i = lid; i < nr_bins; i += l_size) { excess += max(H[i] - clip, 0); }
+		S[lid] = excess;
+
+		int total_excess = scan_local_exclusive(S, lid, l_size);
+
+		for (int i = lid; i < nr_bins; i += l_size) { H[i] = min(H[i], clip) + total_excess / nr_bins + ((i < total_excess % nr_bins) ? 1 : 0); }
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	//	inclusive scan of the clipped histogram, chunk by chunk like hist_equalise_fused
+	int chunk = nr_bins / l_size;
+	int begin = lid * chunk; int end = begin + chunk;
+
+	int sum = 0;
+	for (int i = begin; i < end; i++) { sum += H[i]; }
+	S[lid] = sum;
+
+	scan_local_exclusive(S, lid, l_size);
+
+	//	LUT, the last cumulative bin is nr_pixels (clipping keeps the total)
+	int running = S[lid];
+	for (int i = begin; i < end; i++) {
+		running += H[i];
+		LUTs[(((size_t)c * nr_bins + i) * tiles_y + ty) * tiles_x + tx] = (uchar)(running * (long)(nr_bins - 1) / max(nr_pixels, 1));
+	}
+}
+
+/* CLAHE stage 2: every pixel (2D NDRange over the image, dimension 2 over the channels) is mapped through the LUTs of
+   the four nearest tile centres and the results are blended bilinearly; at the borders the nearest LUTs are used. */
+kernel void clahe_remap(global const uchar* A, global const uchar* LUTs, global uchar* B, int width, int height, int tiles_x, int tiles_y) {
+	int x = get_global_id(0); int y = get_global_id(1); int c = get_global_id(2);
+	if ((x >= width) || (y >= height)) { return; }
+
+	size_t id = ((size_t)c * height + y) * width + x;
+
+	//	position in tile units, relative to the tile centres
+	float gx = clamp((x + 0.5f) * tiles_x / width - 0.5f, 0.0f, (float)(tiles_x - 1));
+	float gy = clamp((y + 0.5f) * tiles_y / height - 0.5f, 0.0f, (float)(tiles_y - 1));
+	int x0 = (int)gx; int x1 = min(x0 + 1, tiles_x - 1); float fx = gx - x0;
+	int y0 = (int)gy; int y1 = min(y0 + 1, tiles_y - 1); float fy = gy - y0;
+
+	global const uchar* L = LUTs + ((size_t)c * 256 + A[id]) * tiles_x * tiles_y;
+	float top = mix((float)L[y0 * tiles_x + x0], (float)L[y0 * tiles_x + x1], fx);
+	float bottom = mix((float)L[y1 * tiles_x + x0], (float)L[y1 * tiles_x + x1], fx);
+
+	B[id] = (uchar)(mix(top, bottom, fy) + 0.5f);
+}
+
+/* 16-bit remap, B[i] = LUT[A[i]]. Samples above the declared maximum (nr_bins - 1) use the last bin, rather than
+   reading past the end of the LUT. */
+kernel void LUT_redirective_ushort(global const ushort* A, global const int* LUT, global ushort* B, int N, int nr_bins) {
+	int id = get_global_id(0);
+
+	if (id < N) { B[id] = LUT[min((int)A[id], nr_bins - 1)]; }
 }
 
 /* Copying all pixels from A to B */
@@ -116,4 +719,299 @@ kernel void LUT_redirective(global uchar* A, global int* LUT, global uchar* B) {
 	B[id] = LUT[A[id]];
 }
 
+/* Luminance-only colour equalisation of planar RGB (CImg layout: all R, then all G, then all B, N pixels per plane).
+   Y is the BT.601 full-range luma of JPEG's YCbCr in 8.8 fixed point. Equalising Y with Cb and Cr held constant moves
+   R, G and B by the same amount (Y has weight 1 in all three rows of the inverse transform), so the back conversion is
+   B = RGB + (LUT[Y] - Y) and neither a Y nor a CbCr plane has to be stored between the kernels. */
+int luma(int r, int g, int b) {
+	return (77 * r + 150 * g + 29 * b + 128) >> 8;
+}
+
+/* Histogram of the luma of N planar RGB pixels, privatised in local memory like hist_local_simple (256 bins). */
+kernel void hist_luma(global const uchar* A, global int* H, local int* LH, int N) {
+	int id = get_global_id(0);
+	int lid = get_local_id(0);
+	int l_size = get_local_size(0);
+
+	for (int i = lid; i < 256; i += l_size) { LH[i] = 0; }
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (id < N) { atomic_inc(&LH[luma(A[id], A[id + N], A[id + 2 * N])]); }
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int i = lid; i < 256; i += l_size) {
+		if (LH[i] != 0) { atomic_add(&H[i], LH[i]); }
+	}
+}
+
+/* Remaps the luma of N planar RGB pixels through LUT and converts back, keeping the chroma of every pixel. A
+   thresholding LUT (Otsu) maps the luma to class levels instead, written to all three channels without chroma. */
+kernel void LUT_redirective_luma(global const uchar* A, global const int* LUT, global uchar* B, int N, int threshold) {
+	int id = get_global_id(0);
+	if (id >= N) { return; }
+
+	int r = A[id], g = A[id + N], b = A[id + 2 * N];
+	int y = luma(r, g, b);
+
+	if (threshold) {
+		B[id] = B[id + N] = B[id + 2 * N] = LUT[y];
+		return;
+	}
+
+	int delta = LUT[y] - y;
+
+	B[id] = clamp(r + delta, 0, 255);
+	B[id + N] = clamp(g + delta, 0, 255);
+	B[id + 2 * N] = clamp(b + delta, 0, 255);
+}
+
+/* 2D convolution of a planar 8-bit image (dimension 2 of the NDRange over the channels) by a (2 * radius + 1)^2 mask
+   held in constant memory. Every work-group first copies its tile plus a halo of radius pixels into T (local memory,
+   (l_width + 2 * radius) x (l_height + 2 * radius) uchar), so each pixel is read from global memory about once.
+   Pixels outside the image repeat the nearest edge pixel (Neumann boundary, CImg's default), and the mask is applied
+   as a convolution, flipped like CImg's get_convolve. The global size is padded up to a multiple of the group size. */
+kernel void convolve_tiled(global const uchar* A, global uchar* B, constant float* mask, local uchar* T, int width, int height, int radius) {
+	int x = get_global_id(0); int y = get_global_id(1); int c = get_global_id(2);
+	int lx = get_local_id(0); int ly = get_local_id(1);
+	int l_width = get_local_size(0); int l_height = get_local_size(1);
+	int tile_width = l_width + 2 * radius; int tile_height = l_height + 2 * radius;
+	int mask_width = 2 * radius + 1;
+
+	global const uchar* P = A + (size_t)c * width * height;
+
+	//	tile and halo, the work-items of the group stride over it together
+	int x_origin = get_group_id(0) * l_width - radius; int y_origin = get_group_id(1) * l_height - radius;
+	for (int i = ly * l_width + lx; i < tile_width * tile_height; i += l_width * l_height) {
+		int tx = clamp(x_origin + i % tile_width, 0, width - 1);
+		int ty = clamp(y_origin + i / tile_width, 0, height - 1);
+		T[i] = P[ty * width + tx];
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if ((x >= width) || (y >= height)) { return; }
+
+	float sum = 0.0f;
+	for (int dy = -radius; dy <= radius; dy++) {
+		for (int dx = -radius; dx <= radius; dx++) {
+			sum += T[(ly + radius + dy) * tile_width + (lx + radius + dx)] * mask[(radius - dy) * mask_width + (radius - dx)];
+		}
+	}
+
+	B[((size_t)c * height + y) * width + x] = convert_uchar_sat_rte(sum);
+}
+
+/* Separable convolution, for masks that are the outer product of a column and a row vector (box, Gaussian): a row pass
+   then a column pass through a float image T_out (no rounding in between), O(2 * (2 * radius + 1)) instead of
+   O((2 * radius + 1)^2) per pixel. Both passes tile through local memory like convolve_tiled, with a halo on one axis
+   only, and use the same edge repetition and mask flip. Dimension 2 of the NDRange runs over the channels. */
+kernel void convolve_rows(global const uchar* A, global float* B, constant float* weights, local float* T, int width, int height, int radius) {
+	int x = get_global_id(0); int y = get_global_id(1); int c = get_global_id(2);
+	int lx = get_local_id(0); int ly = get_local_id(1); int l_width = get_local_size(0);
+	int tile_width = l_width + 2 * radius;
+
+	global const uchar* P = A + (size_t)c * width * height;
+	int row = min(y, height - 1);
+
+	//	one row of the tile (plus halo) per work-item row of the group
+	int x_origin = get_group_id(0) * l_width - radius;
+	for (int i = lx; i < tile_width; i += l_width) { T[ly * tile_width + i] = P[row * width + clamp(x_origin + i, 0, width - 1)]; }
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if ((x >= width) || (y >= height)) { return; }
+
+	float sum = 0.0f;
+	for (int d = -radius; d <= radius; d++) { sum += T[ly * tile_width + lx + radius + d] * weights[radius - d]; }
+
+	B[((size_t)c * height + y) * width + x] = sum;
+}
+
+kernel void convolve_columns(global const float* A, global uchar* B, constant float* weights, local float* T, int width, int height, int radius) {
+	int x = get_global_id(0); int y = get_global_id(1); int c = get_global_id(2);
+	int lx = get_local_id(0); int ly = get_local_id(1); int l_width = get_local_size(0); int l_height = get_local_size(1);
+	int tile_height = l_height + 2 * radius;
+
+	global const float* P = A + (size_t)c * width * height;
+	int column = min(x, width - 1);
+
+	//	one column of the tile (plus halo) per work-item column of the group
+	int y_origin = get_group_id(1) * l_height - radius;
+	for (int i = ly; i < tile_height; i += l_height) { T[i * l_width + lx] = P[clamp(y_origin + i, 0, height - 1) * width + column]; }
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if ((x >= width) || (y >= height)) { return; }
+
+	float sum = 0.0f;
+	for (int d = -radius; d <= radius; d++) { sum += T[(ly + radius + d) * l_width + lx] * weights[radius - d]; }
+
+	B[((size_t)c * height + y) * width + x] = convert_uchar_sat_rte(sum);
+}
+
+/* Image back end: the input is a 2D image of CL_R / CL_UNORM_INT8 texels, width x (height * channels) with the channel
+   planes stacked vertically, read through the texture cache. Pixels come back as value / 255; the x coordinate is clamped
+   by the sampler, the y coordinate by hand so that neighbourhoods never cross into another plane. Outputs are buffers.
+   Only compiled for devices with image support (the host falls back to the buffer kernels otherwise). */
+#ifdef __IMAGE_SUPPORT__
+const sampler_t pixel_sampler = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_NEAREST;
+
+/* Pixel (x, y) of the stacked planes as 0..255. */
+int read_pixel(read_only image2d_t A, int x, int y) {
+	return convert_int_rte(read_imagef(A, pixel_sampler, (int2)(x, y)).x * 255.0f);
+}
+
+/* convolve_tiled on an image: no local tile, the neighbourhood reads hit the texture cache instead. */
+kernel void convolve_image(read_only image2d_t A, global uchar* B, constant float* mask, int width, int height, int radius) {
+	int x = get_global_id(0); int y = get_global_id(1); int c = get_global_id(2);
+	int mask_width = 2 * radius + 1;
+
+	float sum = 0.0f;
+	for (int dy = -radius; dy <= radius; dy++) {
+		int row = c * height + clamp(y + dy, 0, height - 1);
+		for (int dx = -radius; dx <= radius; dx++) {
+			sum += read_pixel(A, x + dx, row) * mask[(radius - dy) * mask_width + (radius - dx)];
+		}
+	}
+
+	B[((size_t)c * height + y) * width + x] = convert_uchar_sat_rte(sum);
+}
+
+/* LUT_redirective on an image, one work-item per pixel of the stacked planes. */
+kernel void LUT_redirective_image(read_only image2d_t A, global const int* LUT, global uchar* B, int width) {
+	int x = get_global_id(0); int y = get_global_id(1);
+
+	B[(size_t)y * width + x] = LUT[read_pixel(A, x, y)];
+}
+
+/* clahe_remap with both lookups in images: the pixel from A, and the bilinear blend of the four tile LUTs done by the
+   sampler's linear filtering on LUTs, a 3D image (tiles_x, tiles_y, 256 * channels) holding the clahe_tile_lut output.
+   Sampling at the centre of a value slice keeps the filter from blending neighbouring values. The filter weights have
+   the hardware's fixed-point precision (8 bits on many devices), so results can differ by one level from clahe_remap. */
+const sampler_t lut_sampler = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_LINEAR;
+
+kernel void clahe_remap_image(read_only image2d_t A, read_only image3d_t LUTs, global uchar* B, int width, int height, int tiles_x, int tiles_y) {
+	int x = get_global_id(0); int y = get_global_id(1); int c = get_global_id(2);
+
+	//	tile centres sit at texel centres, clamping to the edge texels keeps the border tiles flat like clahe_remap
+	float gx = clamp((x + 0.5f) * tiles_x / width, 0.5f, tiles_x - 0.5f);
+	float gy = clamp((y + 0.5f) * tiles_y / height, 0.5f, tiles_y - 0.5f);
+	int v = read_pixel(A, x, c * height + y);
+
+	float level = read_imagef(LUTs, lut_sampler, (float4)(gx, gy, c * 256 + v + 0.5f, 0.0f)).x * 255.0f;
+
+	B[((size_t)c * height + y) * width + x] = convert_uchar_sat_rte(level);
+}
+#endif
+
+/* Vectorised per-pixel kernels: every work-item handles VEC_WIDTH consecutive pixels (set with
+   -DVEC_WIDTH=2|4|8|16 in program.build()), so they are launched with ceil(N / VEC_WIDTH) work-items.
+   The last work-item falls back to scalar accesses when N is not a multiple of the width. */
+#ifndef VEC_WIDTH
+#define VEC_WIDTH 16
+#endif
+
+#define CAT(a, b) a##b
+#define XCAT(a, b) CAT(a, b)
+#define VLOAD XCAT(vload, VEC_WIDTH)
+#define VSTORE XCAT(vstore, VEC_WIDTH)
+
+/* Copies the pixels of work-item id into P and returns how many there are (VEC_WIDTH except at the tail). */
+int load_pixels(global const uchar* A, int id, int N, uchar* P) {
+	int first = id * VEC_WIDTH;
+
+	if (first + VEC_WIDTH <= N) {
+#if VEC_WIDTH > 1
+		VSTORE(VLOAD(id, A), 0, P);
+#else
+		P[0] = A[first];
+#endif
+		return VEC_WIDTH;
+	}
+
+	int n = max(N - first, 0);
+	for (int i = 0; i < n; i++) { P[i] = A[first + i]; }
+	return n;
+}
+
+kernel void hist_simple_vec(global const uchar* A, global int* H, int N) {
+	uchar P[VEC_WIDTH];
+	int n = load_pixels(A, get_global_id(0), N, P);
+
+	for (int i = 0; i < n; i++) { atomic_inc(&H[P[i]]); }
+}
+
+kernel void hist_local_simple_vec(global const uchar* A, global int* H, local int* LH, int nr_bins, int N) {
+	int lid = get_local_id(0); int l_size = get_local_size(0);
+	uchar P[VEC_WIDTH];
+
+	for (int i = lid; i < nr_bins; i += l_size) { LH[i] = 0; }
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	int n = load_pixels(A, get_global_id(0), N, P);
+	for (int i = 0; i < n; i++) { atomic_inc(&LH[P[i]]); }
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int i = lid; i < nr_bins; i += l_size) {
+		if (LH[i] != 0) { atomic_add(&H[i], LH[i]); }
+	}
+}
+
+kernel void hist_local_replicated_vec(global const uchar* A, global int* H, local int* LH, int nr_bins, int N) {
+	int lid = get_local_id(0); int l_size = get_local_size(0);
+	int replica = lid % HIST_REPLICAS;
+	uchar P[VEC_WIDTH];
+
+	for (int i = lid; i < nr_bins * HIST_REPLICAS; i += l_size) { LH[i] = 0; }
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	int n = load_pixels(A, get_global_id(0), N, P);
+	for (int i = 0; i < n; i++) { atomic_inc(&LH[P[i] * HIST_REPLICAS + replica]); }
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int i = lid; i < nr_bins; i += l_size) {
+		int sum = 0;
+		for (int r = 0; r < HIST_REPLICAS; r++) { sum += LH[i * HIST_REPLICAS + r]; }
+		if (sum != 0) { atomic_add(&H[i], sum); }
+	}
+}
+
+kernel void LUT_redirective_vec(global const uchar* A, global const int* LUT, global uchar* B, int N) {
+	int id = get_global_id(0);
+	uchar P[VEC_WIDTH];
+
+	int n = load_pixels(A, id, N, P);
+	for (int i = 0; i < n; i++) { P[i] = LUT[P[i]]; }
+
+#if VEC_WIDTH > 1
+	if (n == VEC_WIDTH) { VSTORE(VLOAD(0, P), id, B); return; }
+#endif
+	for (int i = 0; i < n; i++) { B[id * VEC_WIDTH + i] = P[i]; }
+}
+
+/* Remap with the compact LUT of LUT_table_uchar: the 256 bytes are copied into local memory (L) once per work-group,
+   so the only global traffic per pixel is the pixel read and the pixel write. VEC_WIDTH pixels per work-item, the
+   global size is padded up to a multiple of the work-group size. */
+kernel void LUT_redirective_compact(global const uchar* A, global const uchar* LUT, global uchar* B, local uchar* L, int N) {
+	int id = get_global_id(0);
+	int lid = get_local_id(0); int l_size = get_local_size(0);
+	uchar P[VEC_WIDTH];
+
+	for (int i = lid; i < 256; i += l_size) { L[i] = LUT[i]; }
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	int n = load_pixels(A, id, N, P);
+	for (int i = 0; i < n; i++) { P[i] = L[P[i]]; }
+
+#if VEC_WIDTH > 1
+	if (n == VEC_WIDTH) { VSTORE(VLOAD(0, P), id, B); return; }
+#endif
+	for (int i = 0; i < n; i++) { B[id * VEC_WIDTH + i] = P[i]; }
+}
+
 /* ?? */
@@ -0,0 +1,96 @@
+/*Generic image statistics kernels, specialised at build time (see StatsEngine in Utils.h)*/
+
+/* STATS_T    : element type, uchar | ushort | float
+   STATS_ACC  : accumulator type, ulong for integer elements, double (float on devices without cl_khr_fp64) for float
+   STATS_FLOAT: 1 for floating point elements (values can be negative or infinite), 0 for integers */
+#ifndef STATS_T
+#define STATS_T uchar
+#endif
+
+#ifndef STATS_ACC
+#define STATS_ACC ulong
+#endif
+
+#ifndef STATS_FLOAT
+#define STATS_FLOAT 0
+#endif
+
+#ifdef cl_khr_fp64
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+#endif
+
+#define CONCAT(a, b) a##b
+#define EXPAND_CONCAT(a, b) CONCAT(a, b)
+#define STATS_ACC8 EXPAND_CONCAT(STATS_ACC, 8)
+#define CONVERT_STATS_ACC8 EXPAND_CONCAT(convert_, STATS_ACC8)
+
+//starting values of the running minimum and maximum
+#if STATS_FLOAT
+#define STATS_MIN_START INFINITY
+#define STATS_MAX_START (-INFINITY)
+#else
+#define STATS_MIN_START ULONG_MAX
+#define STATS_MAX_START 0
+#endif
+
+STATS_ACC hmin8(STATS_ACC8 v) { return min(min(min(v.s0, v.s1), min(v.s2, v.s3)), min(min(v.s4, v.s5), min(v.s6, v.s7))); }
+STATS_ACC hmax8(STATS_ACC8 v) { return max(max(max(v.s0, v.s1), max(v.s2, v.s3)), max(max(v.s4, v.s5), max(v.s6, v.s7))); }
+STATS_ACC hsum8(STATS_ACC8 v) { return ((v.s0 + v.s1) + (v.s2 + v.s3)) + ((v.s4 + v.s5) + (v.s6 + v.s7)); }
+
+//tree reduction of the private statistics of the work-group, written by work-item 0 to R[0..3]
+void reduce_stats_local(local STATS_ACC* L, STATS_ACC lo, STATS_ACC hi, STATS_ACC sum, STATS_ACC squares, global STATS_ACC* R) {
+	int lid = get_local_id(0); int l_size = get_local_size(0);
+	local STATS_ACC* L_min = L; local STATS_ACC* L_max = L + l_size; local STATS_ACC* L_sum = L + 2 * l_size; local STATS_ACC* L_squares = L + 3 * l_size;
+
+	L_min[lid] = lo; L_max[lid] = hi; L_sum[lid] = sum; L_squares[lid] = squares;
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int stride = l_size / 2; stride > 0; stride /= 2) {
+		if (lid < stride) {
+			L_min[lid] = min(L_min[lid], L_min[lid + stride]);
+			L_max[lid] = max(L_max[lid], L_max[lid + stride]);
+			L_sum[lid] += L_sum[lid + stride];
+			L_squares[lid] += L_squares[lid + stride];
+		}
+
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	if (lid == 0) { R[0] = L_min[0]; R[1] = L_max[0]; R[2] = L_sum[0]; R[3] = L_squares[0]; }
+}
+
+/* Image statistics, stage 1 of 2: every work-group reduces a grid-strided share of the N values to (min, max, sum,
+   sum of squares), 4 accumulators per group in P. Values are loaded 8 at a time, the tail that does not fill a
+   vector one at a time. The local size must be a power of two, L holds 4 accumulators per work-item. */
+kernel void reduce_stats(global const STATS_T* A, global STATS_ACC* P, local STATS_ACC* L, int N) {
+	int id = get_global_id(0); int g_size = get_global_size(0);
+	STATS_ACC lo = STATS_MIN_START, hi = STATS_MAX_START, sum = 0, squares = 0;
+
+	for (int i = id; i < N / 8; i += g_size) {
+		STATS_ACC8 v = CONVERT_STATS_ACC8(vload8(i, A));
+		lo = min(lo, hmin8(v)); hi = max(hi, hmax8(v));
+		sum += hsum8(v); squares += hsum8(v * v);
+	}
+
+	for (int i = (N / 8) * 8 + id; i < N; i += g_size) {
+		STATS_ACC v = A[i];
+		lo = min(lo, v); hi = max(hi, v); sum += v; squares += v * v;
+	}
+
+	reduce_stats_local(L, lo, hi, sum, squares, P + get_group_id(0) * 4);
+}
+
+/* Image statistics, stage 2 of 2, on a single power-of-two work-group: the nr_groups partials of reduce_stats
+   reduced into R (min, max, sum, sum of squares). */
+kernel void reduce_stats_groups(global const STATS_ACC* P, global STATS_ACC* R, local STATS_ACC* L, int nr_groups) {
+	int lid = get_local_id(0); int l_size = get_local_size(0);
+	STATS_ACC lo = STATS_MIN_START, hi = STATS_MAX_START, sum = 0, squares = 0;
+
+	for (int g = lid; g < nr_groups; g += l_size) {
+		lo = min(lo, P[g * 4]); hi = max(hi, P[g * 4 + 1]);
+		sum += P[g * 4 + 2]; squares += P[g * 4 + 3];
+	}
+
+	reduce_stats_local(L, lo, hi, sum, squares, R);
+}
@@ -1,8 +1,11 @@
 #pragma once
 
+#include <algorithm>
+#include <filesystem>
 #include <fstream>
 #include <vector>
 #include <iostream>
+#include <map>
 #include <sstream>
 
 #define CL_USE_DEPRECATED_OPENCL_1_2_APIS
@@ -128,6 +131,97 @@ void AddSources(cl::Program::Sources& sources, const string& file_name) {
 	sources.push_back((*source_code).c_str());
 }
 
+/* 64-bit FNV-1a hash of text, continuing from hash. */
+unsigned long long HashString(const string& text, unsigned long long hash = 14695981039346656037ULL) {
+	for (unsigned char c : text) {
+		hash ^= c;
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+/* Builds a program from source_code with build_options, printing the build log on failure. */
+cl::Program BuildProgram(const cl::Context& context, const string& source_code, const string& build_options) {
+	cl::Program::Sources sources;
+	sources.push_back(source_code);
+
+	cl::Program program(context, sources);
+
+	//build and debug the kernel code
+	try {
+		program.build(build_options.c_str());
+	}
+	catch (const cl::Error& err) {
+		cout << "Build Status: " << program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << endl;
+		cout << "Build Options:\t" << program.getBuildInfo<CL_PROGRAM_BUILD_OPTIONS>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << endl;
+		cout << "Build Log:\t " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << endl;
+		throw err;
+	}
+
+	return program;
+}
+
+/* Builds the kernels in file_name for the device of context through an on-disk cache of CL_PROGRAM_BINARIES.
+   Entries are keyed by a hash of the source text, the build options, the device name and the device and driver
+   versions, so any change to one of them misses the cache and the program is compiled and stored again.
+   A cache hit only loads and links the binary; an unreadable or rejected entry is rebuilt from source and overwritten.
+   An empty cache_dir disables the cache. */
+cl::Program BuildProgramCached(const cl::Context& context, const string& file_name, const string& build_options, const string& cache_dir) {
+	ifstream file(file_name);
+	if (!file) {
+		cerr << "Cannot open kernel source " << file_name << endl;
+		throw cl::Error(CL_INVALID_VALUE, "BuildProgramCached");
+	}
+	string source_code((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+
+	if (cache_dir.empty()) { return BuildProgram(context, source_code, build_options); }
+
+	cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+
+	unsigned long long key = HashString(source_code);
+	key = HashString(string(1, '\0') + build_options, key);
+	key = HashString(string(1, '\0') + device.getInfo<CL_DEVICE_NAME>(), key);
+	key = HashString(string(1, '\0') + device.getInfo<CL_DEVICE_VERSION>(), key);
+	key = HashString(string(1, '\0') + device.getInfo<CL_DRIVER_VERSION>(), key);
+
+	stringstream name;
+	name << hex << key << ".bin";
+	filesystem::path cache_file = filesystem::path(cache_dir) / name.str();
+
+	ifstream cached(cache_file, ios::binary);
+	if (cached) {
+		cl::Program::Binaries binaries(1, vector<unsigned char>((istreambuf_iterator<char>(cached)), istreambuf_iterator<char>()));
+
+		try {
+			cl::Program program(context, { device }, binaries);
+			program.build(build_options.c_str());
+			return program;
+		}
+		catch (const cl::Error&) {
+			cerr << "Program cache entry " << cache_file.string() << " is stale, rebuilding" << endl;
+		}
+	}
+
+	cl::Program program = BuildProgram(context, source_code, build_options);
+
+	//store the binary next to the others, via a temporary file so that a partial write is never picked up
+	cl::Program::Binaries binaries = program.getInfo<CL_PROGRAM_BINARIES>();
+	if (!binaries.empty() && !binaries[0].empty()) {
+		error_code error;
+		filesystem::create_directories(cache_dir, error);
+
+		filesystem::path temporary_file = cache_file;
+		temporary_file += ".tmp";
+		{
+			ofstream output(temporary_file, ios::binary);
+			output.write((const char*)binaries[0].data(), binaries[0].size());
+		}
+		filesystem::rename(temporary_file, cache_file, error);
+	}
+
+	return program;
+}
+
 string ListPlatformsDevices() {
 
 	stringstream sstream;
@@ -222,4 +316,311 @@ string GetFullProfilingInfo(const cl::Event& evnt, ProfilingResolution resolutio
 	}
 
 	return sstream.str();
-}
\ No newline at end of file
+}
+
+/* Elements per work-item of the scan_blocks/scan_add_offsets kernels, passed to my_kernels.cl as -DSCAN_ITEMS. */
+#define SCAN_ITEMS 4
+
+enum ScanMode {
+	SCAN_HIERARCHICAL,	//scan blocks, scan block sums recursively, add offsets: reads and writes the data twice
+	SCAN_LOOKBACK		//single pass with decoupled look-back between work-groups: reads and writes the data once
+};
+
+/* Largest power-of-two work-group size, up to cap, the device accepts for kernel. For kernels launched together with
+   the same local size, the smallest of their results fits all of them. */
+size_t PowerOfTwoLocalSize(const cl::Kernel& kernel, const cl::Device& device, size_t cap = 256) {
+	size_t max_size = std::min<size_t>(cap, kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device));
+	size_t local_size = 1;
+	while (local_size * 2 <= max_size) { local_size *= 2; }
+	return local_size;
+}
+
+/* Hierarchical (scan-then-propagate) prefix sum of N ints from input to output (which may be the same buffer),
+   using the scan_blocks and scan_add_offsets kernels of program: every block is scanned in local memory,
+   the block sums are scanned recursively and then added back to their blocks. Commands are enqueued without
+   blocking, the first one after wait_events; the returned event completes with the last of them. */
+cl::Event EnqueueScanHierarchical(cl::CommandQueue& queue, cl::Program& program, const cl::Buffer& input, cl::Buffer& output, size_t N, bool inclusive, const vector<cl::Event>* wait_events = NULL) {
+	cl::Context context = queue.getInfo<CL_QUEUE_CONTEXT>();
+	cl::Device device = queue.getInfo<CL_QUEUE_DEVICE>();
+	cl::Event event;
+
+	cl::Kernel kernel_scan_blocks(program, "scan_blocks");
+	size_t local_size = PowerOfTwoLocalSize(kernel_scan_blocks, device);
+
+	size_t block_size = local_size * SCAN_ITEMS;
+	size_t nr_blocks = (N + block_size - 1) / block_size;
+
+	cl::Buffer block_sums(context, CL_MEM_READ_WRITE, nr_blocks * sizeof(int));
+
+	kernel_scan_blocks.setArg(0, input);
+	kernel_scan_blocks.setArg(1, output);
+	kernel_scan_blocks.setArg(2, block_sums);
+	kernel_scan_blocks.setArg(3, cl::Local(local_size * sizeof(int)));
+	kernel_scan_blocks.setArg(4, (int)N);
+	kernel_scan_blocks.setArg(5, (int)inclusive);
+
+	queue.enqueueNDRangeKernel(kernel_scan_blocks, cl::NullRange, cl::NDRange(nr_blocks * local_size), cl::NDRange(local_size), wait_events, &event);
+
+	if (nr_blocks > 1) {
+		//block offsets = exclusive scan of the block sums, in place
+		vector<cl::Event> blocks_done = { event };
+		vector<cl::Event> offsets_done = { EnqueueScanHierarchical(queue, program, block_sums, block_sums, nr_blocks, false, &blocks_done) };
+
+		cl::Kernel kernel_add_offsets(program, "scan_add_offsets");
+		kernel_add_offsets.setArg(0, output);
+		kernel_add_offsets.setArg(1, block_sums);
+		kernel_add_offsets.setArg(2, (int)N);
+
+		queue.enqueueNDRangeKernel(kernel_add_offsets, cl::NullRange, cl::NDRange(nr_blocks * local_size), cl::NDRange(local_size), &offsets_done, &event);
+	}
+
+	//the temporary buffers are released by the runtime once the enqueued kernels no longer need them
+	return event;
+}
+
+/* Single-pass prefix sum of N ints from input to output (distinct buffers) with the scan_lookback kernel:
+   every element is read and written once, tiles exchange their running totals through per-tile flags. */
+cl::Event EnqueueScanLookback(cl::CommandQueue& queue, cl::Program& program, const cl::Buffer& input, cl::Buffer& output, size_t N, bool inclusive, const vector<cl::Event>* wait_events = NULL) {
+	cl::Context context = queue.getInfo<CL_QUEUE_CONTEXT>();
+	cl::Device device = queue.getInfo<CL_QUEUE_DEVICE>();
+	cl::Event event;
+
+	cl::Kernel kernel_scan_lookback(program, "scan_lookback");
+	size_t local_size = PowerOfTwoLocalSize(kernel_scan_lookback, device);
+
+	size_t tile_size = local_size * SCAN_ITEMS;
+	size_t nr_tiles = std::max<size_t>(1, (N + tile_size - 1) / tile_size);
+
+	cl::Buffer tile_flags(context, CL_MEM_READ_WRITE, nr_tiles * sizeof(int));
+	cl::Buffer tile_values(context, CL_MEM_READ_WRITE, 2 * nr_tiles * sizeof(int));
+	cl::Buffer tile_counter(context, CL_MEM_READ_WRITE, sizeof(int));
+
+	vector<cl::Event> cleared(2);
+	queue.enqueueFillBuffer(tile_flags, 0, 0, nr_tiles * sizeof(int), wait_events, &cleared[0]);
+	queue.enqueueFillBuffer(tile_counter, 0, 0, sizeof(int), wait_events, &cleared[1]);
+
+	kernel_scan_lookback.setArg(0, input);
+	kernel_scan_lookback.setArg(1, output);
+	kernel_scan_lookback.setArg(2, tile_flags);
+	kernel_scan_lookback.setArg(3, tile_values);
+	kernel_scan_lookback.setArg(4, tile_counter);
+	kernel_scan_lookback.setArg(5, cl::Local(local_size * sizeof(int)));
+	kernel_scan_lookback.setArg(6, (int)N);
+	kernel_scan_lookback.setArg(7, (int)inclusive);
+
+	queue.enqueueNDRangeKernel(kernel_scan_lookback, cl::NullRange, cl::NDRange(nr_tiles * local_size), cl::NDRange(local_size), &cleared, &event);
+
+	return event;
+}
+
+/* Prefix sum of N ints with the selected algorithm, see EnqueueScanHierarchical and EnqueueScanLookback. The program
+   must be built with -DSCAN_ITEMS=<SCAN_ITEMS> unless SCAN_ITEMS keeps the kernel default (4). */
+cl::Event EnqueueScan(cl::CommandQueue& queue, cl::Program& program, const cl::Buffer& input, cl::Buffer& output, size_t N, bool inclusive, ScanMode mode = SCAN_HIERARCHICAL, const vector<cl::Event>* wait_events = NULL) {
+	if (mode == SCAN_LOOKBACK) { return EnqueueScanLookback(queue, program, input, output, N, inclusive, wait_events); }
+	return EnqueueScanHierarchical(queue, program, input, output, N, inclusive, wait_events);
+}
+
+/* Histogram of N unsigned values (element_size 2 for ushort, 4 for uint) into nr_bins bins of H, which is zeroed
+   first, with the range-partitioned hist_ranged_ kernels. The bins are split into slices as large as the local memory
+   of the device allows (CL_DEVICE_LOCAL_MEM_SIZE less what the kernel already uses); each work-group counts one slice
+   over one chunk of the input. With few slices the input is cut into more chunks to keep every compute unit busy,
+   with many slices every group streams the whole input. */
+cl::Event EnqueueHistogramRanged(cl::CommandQueue& queue, cl::Program& program, const cl::Buffer& input, size_t element_size, size_t N,
+	cl::Buffer& H, size_t nr_bins, const vector<cl::Event>* wait_events = NULL) {
+	cl::Device device = queue.getInfo<CL_QUEUE_DEVICE>();
+	cl::Event event;
+
+	cl::Kernel kernel_hist(program, (element_size == 2) ? "hist_ranged_ushort" : "hist_ranged_uint");
+
+	cl_ulong local_memory = device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>() - kernel_hist.getWorkGroupInfo<CL_KERNEL_LOCAL_MEM_SIZE>(device);
+	size_t range_size = std::min<size_t>(nr_bins, std::max<size_t>(256, (size_t)(local_memory / sizeof(int)) & ~(size_t)255));
+	size_t nr_slices = (nr_bins + range_size - 1) / range_size;
+
+	size_t local_size = std::min<size_t>(256, kernel_hist.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device));
+	size_t wanted_groups = device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * 4;
+	size_t nr_chunks = std::max<size_t>(1, std::min((wanted_groups + nr_slices - 1) / nr_slices, N / (local_size * 16)));
+	size_t chunk_size = (N + nr_chunks - 1) / nr_chunks;
+
+	vector<cl::Event> cleared(1);
+	queue.enqueueFillBuffer(H, 0, 0, nr_bins * sizeof(int), wait_events, &cleared[0]);
+
+	kernel_hist.setArg(0, input);
+	kernel_hist.setArg(1, H);
+	kernel_hist.setArg(2, cl::Local(range_size * sizeof(int)));
+	kernel_hist.setArg(3, (int)N);
+	kernel_hist.setArg(4, (int)nr_bins);
+	kernel_hist.setArg(5, (int)range_size);
+	kernel_hist.setArg(6, (int)chunk_size);
+
+	queue.enqueueNDRangeKernel(kernel_hist, cl::NullRange, cl::NDRange(nr_chunks * local_size, nr_slices), cl::NDRange(local_size, 1), &cleared, &event);
+
+	return event;
+}
+
+/* OpenCL C name of a host element type, used to specialise kernels with -D options. */
+template <typename T> string ClTypeName();
+template <> string ClTypeName<unsigned char>() { return "uchar"; }
+template <> string ClTypeName<unsigned short>() { return "ushort"; }
+template <> string ClTypeName<int>() { return "int"; }
+template <> string ClTypeName<float>() { return "float"; }
+
+/* Histograms of arbitrary numeric data with hist_generic from kernels/histogram_generic.cl. The element type and the
+   bin count are compiled into the kernel (-DHIST_T, -DHIST_BINS), so every combination is a separate program: each one
+   is built on first use through BuildProgramCached and kept in programs for the following calls. Bin counts that fit
+   in local memory get the privatised kernel, larger ones count straight into global memory. */
+struct HistogramEngine {
+	cl::Context context;
+	string file_name;
+	string cache_dir;
+	map<string, cl::Program> programs;
+
+	HistogramEngine(const cl::Context& context, const string& file_name = "kernels/histogram_generic.cl", const string& cache_dir = "")
+		: context(context), file_name(file_name), cache_dir(cache_dir) {}
+
+	template <typename T>
+	cl::Program& Program(size_t nr_bins) {
+		cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+		bool local = nr_bins * sizeof(int) <= device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>() / 2;
+
+		stringstream options;
+		options << "-DHIST_T=" << ClTypeName<T>() << " -DHIST_BINS=" << nr_bins
+			<< " -DHIST_FLOAT=" << (int)is_floating_point<T>::value << " -DHIST_LOCAL=" << (int)local;
+
+		auto found = programs.find(options.str());
+		if (found != programs.end()) { return found->second; }
+
+		return programs[options.str()] = BuildProgramCached(context, file_name, options.str(), cache_dir);
+	}
+
+	/* Histogram of N values of input into the nr_bins ints of H (zeroed first), with equal bins over [min_value, max_value). */
+	template <typename T>
+	cl::Event Enqueue(cl::CommandQueue& queue, const cl::Buffer& input, size_t N, size_t nr_bins, T min_value, T max_value,
+		cl::Buffer& H, const vector<cl::Event>* wait_events = NULL) {
+		cl::Device device = queue.getInfo<CL_QUEUE_DEVICE>();
+		cl::Event event;
+
+		cl::Kernel kernel_hist(Program<T>(nr_bins), "hist_generic");
+
+		size_t local_size = std::min<size_t>(256, kernel_hist.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device));
+		size_t nr_groups = std::max<size_t>(1, std::min<size_t>(device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * 4, (N + local_size - 1) / local_size));
+
+		vector<cl::Event> cleared(1);
+		queue.enqueueFillBuffer(H, 0, 0, nr_bins * sizeof(int), wait_events, &cleared[0]);
+
+		kernel_hist.setArg(0, input);
+		kernel_hist.setArg(1, H);
+		kernel_hist.setArg(2, (int)N);
+		kernel_hist.setArg(3, min_value);
+		kernel_hist.setArg(4, max_value);
+
+		queue.enqueueNDRangeKernel(kernel_hist, cl::NullRange, cl::NDRange(nr_groups * local_size), cl::NDRange(local_size), &cleared, &event);
+
+		return event;
+	}
+};
+
+/* Image statistics of every value of a buffer, variance of the population. */
+struct ImageStats {
+	double min = 0.0, max = 0.0;
+	double mean = 0.0, variance = 0.0;
+};
+
+/* Work-groups of the first stage of StatsEngine, each reducing a grid-strided share of the values. */
+#define STATS_GROUPS 64
+
+/* Min, max, mean and variance of uchar, ushort or float data with the two-stage reduction of kernels/stats_generic.cl:
+   reduce_stats leaves STATS_GROUPS partials, reduce_stats_groups reduces them into result and only those 4 values are
+   read back. The element type and the accumulator (ulong for integers, double for float, or float on devices without
+   cl_khr_fp64) are compiled in (-DSTATS_T, -DSTATS_ACC), one program per element type built and kept like HistogramEngine. */
+struct StatsEngine {
+	cl::Context context;
+	string file_name;
+	string cache_dir;
+	map<string, cl::Program> programs;
+	cl::Buffer partials, result; //STATS_GROUPS x 4 and 4 accumulators of up to 8 bytes
+
+	StatsEngine(const cl::Context& context, const string& file_name = "kernels/stats_generic.cl", const string& cache_dir = "")
+		: context(context), file_name(file_name), cache_dir(cache_dir),
+		partials(context, CL_MEM_READ_WRITE, STATS_GROUPS * 4 * sizeof(cl_ulong)), result(context, CL_MEM_READ_WRITE, 4 * sizeof(cl_ulong)) {}
+
+	template <typename T>
+	string Accumulator() {
+		if (!is_floating_point<T>::value) { return "ulong"; }
+
+		cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+		return (device.getInfo<CL_DEVICE_EXTENSIONS>().find("cl_khr_fp64") != string::npos) ? "double" : "float";
+	}
+
+	template <typename T>
+	cl::Program& Program() {
+		stringstream options;
+		options << "-DSTATS_T=" << ClTypeName<T>() << " -DSTATS_ACC=" << Accumulator<T>() << " -DSTATS_FLOAT=" << (int)is_floating_point<T>::value;
+
+		auto found = programs.find(options.str());
+		if (found != programs.end()) { return found->second; }
+
+		return programs[options.str()] = BuildProgramCached(context, file_name, options.str(), cache_dir);
+	}
+
+	/* Enqueues both stages over N values of input, the 4 totals (min, max, sum, sum of squares) end up in result.
+	   Returns the event of the second stage. */
+	template <typename T>
+	cl::Event Enqueue(cl::CommandQueue& queue, const cl::Buffer& input, size_t N, const vector<cl::Event>* wait_events = NULL) {
+		cl::Device device = queue.getInfo<CL_QUEUE_DEVICE>();
+		size_t acc_size = (Accumulator<T>() == "float") ? sizeof(cl_float) : sizeof(cl_ulong);
+
+		cl::Kernel kernel_stats(Program<T>(), "reduce_stats");
+		cl::Kernel kernel_groups(Program<T>(), "reduce_stats_groups");
+		size_t local_size = std::min(PowerOfTwoLocalSize(kernel_stats, device), PowerOfTwoLocalSize(kernel_groups, device));
+
+		kernel_stats.setArg(0, input);
+		kernel_stats.setArg(1, partials);
+		kernel_stats.setArg(2, cl::Local(4 * local_size * acc_size));
+		kernel_stats.setArg(3, (int)N);
+
+		vector<cl::Event> reduced(1);
+		queue.enqueueNDRangeKernel(kernel_stats, cl::NullRange, cl::NDRange(STATS_GROUPS * local_size), cl::NDRange(local_size), wait_events, &reduced[0]);
+
+		kernel_groups.setArg(0, partials);
+		kernel_groups.setArg(1, result);
+		kernel_groups.setArg(2, cl::Local(4 * local_size * acc_size));
+		kernel_groups.setArg(3, STATS_GROUPS);
+
+		cl::Event event;
+		queue.enqueueNDRangeKernel(kernel_groups, cl::NullRange, cl::NDRange(local_size), cl::NDRange(local_size), &reduced, &event);
+
+		return event;
+	}
+
+	/* Statistics of N values of input, computed on the device and read back once. */
+	template <typename T>
+	ImageStats Compute(cl::CommandQueue& queue, const cl::Buffer& input, size_t N, const vector<cl::Event>* wait_events = NULL) {
+		ImageStats stats;
+		if (N == 0) { return stats; }
+
+		vector<cl::Event> reduced(1, Enqueue<T>(queue, input, N, wait_events));
+
+		double totals[4];
+		string accumulator = Accumulator<T>();
+		if (accumulator == "ulong") {
+			cl_ulong values[4];
+			queue.enqueueReadBuffer(result, CL_TRUE, 0, sizeof(values), values, &reduced);
+			for (int i = 0; i < 4; i++) { totals[i] = (double)values[i]; }
+		}
+		else if (accumulator == "double") {
+			queue.enqueueReadBuffer(result, CL_TRUE, 0, sizeof(totals), totals, &reduced);
+		}
+		else {
+			cl_float values[4];
+			queue.enqueueReadBuffer(result, CL_TRUE, 0, sizeof(values), values, &reduced);
+			for (int i = 0; i < 4; i++) { totals[i] = values[i]; }
+		}
+
+		stats.min = totals[0];
+		stats.max = totals[1];
+		stats.mean = totals[2] / N;
+		stats.variance = std::max(totals[3] / N - stats.mean * stats.mean, 0.0);
+
+		return stats;
+	}
+};